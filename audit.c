@@ -0,0 +1,455 @@
+/*
+ * onpts is a too to securely access the input buffer of other pseudo terminals
+ * Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdbool.h>
+#include <libgen.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "proc.h"
+#include "audit.h"
+
+/*
+ * The audit log is a ring of fixed size records in a memory mapped file.
+ *
+ * Appending does not need a lock, even with several onpts processes at the same time:
+ *  1. The writer takes a ticket: an atomic increment of header.next
+ *  2. It claims record ticket % capacity by setting its sequence to (ticket + 1) | AUDIT_BUSY,
+ *     writes the record, and then sets the sequence to ticket + 1
+ * A reader only accepts a record if its sequence is the same before and after copying it,
+ * and the checksum matches.
+ *
+ * Only a writer that stalls while the others fill the whole ring can meet a newer record
+ * in its slot. Its own record is older than anything in the ring then, so it gets dropped.
+ * If the newer writer comes while the stalled one is still writing, the record may end up torn.
+ * The checksum makes readers skip it.
+ *
+ * The file does not get synced for each record. At most once per AUDIT_SYNC_INTERVAL_MS
+ * one writer starts the writeback to disk, without waiting for it.
+ *
+ * The log belongs to root. When onpts is not installed with the suid bit,
+ * it cannot open the log and nothing gets recorded.
+ */
+
+_Static_assert(sizeof(struct AUDITRECORD) == 256, "Audit records must have 256 bytes");
+_Static_assert(sizeof(struct AUDITHEADER) <= AUDIT_HEADER_SIZE, "Audit header too large");
+
+#define FNV_OFFSET_BASIS    14695981039346656037ULL
+#define FNV_PRIME           1099511628211ULL
+
+static struct AUDITHEADER *global_header  = NULL;
+static struct AUDITRECORD *global_records = NULL;
+static int                 global_fd      = -1;
+static bool                global_failed  = false;
+static struct AUDITRECORD *global_capture = NULL;
+
+static size_t AuditLogSize(void);
+static uint32_t Checksum(const struct AUDITRECORD *record);
+static int    InitializeHeader(int fd);
+static void   PrintRecord(const struct AUDITRECORD *record, bool json);
+
+
+/*
+ * Returns the path of the audit log: AUDIT_PATH, or $ONPTS_AUDITLOG for testing.
+ * The environment variable gets ignored when onpts runs with the suid bit set.
+ */
+const char *AuditPath(void)
+{
+    const char *path = secure_getenv("ONPTS_AUDITLOG");
+    if(path && path[0] != '\0')
+        return path;
+    return AUDIT_PATH;
+}
+
+
+
+/*
+ * Opens and maps the audit log. It gets created if it does not exist.
+ * The log stays mapped until onpts exits.
+ *
+ * Returns:
+ *  0 if the log can be written, -1 otherwise
+ */
+int AuditOpen(void)
+{
+    if(global_header)
+        return 0;
+    if(global_failed)
+        return -1;
+    global_failed = true;   // Only try once
+
+    char *directory = strdup(AuditPath());
+    if(directory == NULL)
+        return -1;
+    mkdir(dirname(directory), 0700);
+    free(directory);
+
+    int fd = open(AuditPath(), O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if(fd < 0)
+    {
+#ifdef DEBUG
+        printf("\e[1;34mNo audit log: \e[0;36m%s\e[0m\n", strerror(errno));
+#endif
+        return -1;
+    }
+
+    if(InitializeHeader(fd) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, AuditLogSize(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED)
+    {
+        fprintf(stderr, "\e[1;31mMapping the audit log failed with error: ");
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    global_header  = (struct AUDITHEADER*)map;
+    global_records = (struct AUDITRECORD*)((char*)map + AUDIT_HEADER_SIZE);
+    global_fd      = fd;
+    global_failed  = false;
+    return 0;
+}
+
+
+
+/*
+ * Starts a record for an injection into a PTS
+ */
+void AuditBegin(struct AUDITRECORD *record, uint8_t mode, const char *ptspath)
+{
+    memset(record, 0, sizeof(struct AUDITRECORD));
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record->time        = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+    record->uid         = getuid();
+    record->gid         = getgid();
+    record->pid         = getpid();
+    record->ptsnum      = PTSNumberFromPath(ptspath);
+    record->mode        = mode;
+    record->verdict     = AUDIT_VERDICT_DENY;
+    record->payloadhash = FNV_OFFSET_BASIS;
+}
+
+
+
+/*
+ * Adds the processes visited by the privilege check to a record
+ */
+void AuditProcesses(struct AUDITRECORD *record, const struct CHECKTRACE *trace)
+{
+    record->numprocs = trace->numnodes;
+    for(size_t i = 0; i < trace->numnodes && i < AUDIT_MAX_PIDS; i++)
+        record->procs[i] = trace->nodes[i].pid;
+}
+
+
+
+/*
+ * All bytes sent by SendChar get added to the payload of record, until AuditCapture(NULL) gets called
+ */
+void AuditCapture(struct AUDITRECORD *record)
+{
+    global_capture = record;
+}
+
+
+
+void AuditSentBytes(const char *bytes, size_t length)
+{
+    if(global_capture == NULL)
+        return;
+
+    uint64_t hash = global_capture->payloadhash;
+    for(size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)bytes[i];
+        hash *= FNV_PRIME;
+    }
+    global_capture->payloadhash  = hash;
+    global_capture->payloadsize += length;
+}
+
+
+
+/*
+ * Appends a record to the audit log.
+ *
+ * Returns:
+ *  0 on success, -1 if there is no audit log
+ */
+int AuditWrite(struct AUDITRECORD *record)
+{
+    if(AuditOpen() != 0)
+        return -1;
+
+    uint64_t ticket = __atomic_fetch_add(&global_header->next, 1, __ATOMIC_RELAXED);
+    uint64_t sequence = ticket + 1;
+    struct AUDITRECORD *slot = &global_records[ticket % global_header->capacity];
+
+    record->sequence = sequence;
+    record->checksum = 0;
+    record->checksum = Checksum(record);
+
+    uint64_t current = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+    do
+    {
+        if((current & ~AUDIT_BUSY) >= sequence)
+            return 0;   // A newer record is already there
+    } while(!__atomic_compare_exchange_n(&slot->sequence, &current, sequence | AUDIT_BUSY, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+    memcpy((char*)slot + sizeof(slot->sequence), (char*)record + sizeof(record->sequence),
+            sizeof(struct AUDITRECORD) - sizeof(record->sequence));
+
+    current = sequence | AUDIT_BUSY;
+    __atomic_compare_exchange_n(&slot->sequence, &current, sequence, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+
+    // Periodic writeback - only the writer that updates lastsync starts it
+    int64_t now  = AuditClock();
+    int64_t last = __atomic_load_n(&global_header->lastsync, __ATOMIC_RELAXED);
+    if(now - last >= AUDIT_SYNC_INTERVAL_MS * 1000000LL || now < last)
+    {
+        if(__atomic_compare_exchange_n(&global_header->lastsync, &last, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            sync_file_range(global_fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+    return 0;
+}
+
+
+
+long long AuditClock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+
+/*
+ * Prints all records of the audit log, oldest first.
+ * Only root may read the log.
+ *
+ * Args:
+ *  format: "json" for one JSON object per line, "tsv" for tab separated values
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int ExportAudit(const char *format)
+{
+    bool json = strncmp(format, "json", 8) == 0;
+    if(!json && strncmp(format, "tsv", 8) != 0)
+    {
+        fprintf(stderr, "\e[1;31mUnknown audit format %s! Use json or tsv.\e[0m\n", format);
+        return -1;
+    }
+    if(getuid() != 0)
+    {
+        fprintf(stderr, "\e[1;31mOnly root may read the audit log!\e[0m\n");
+        return -1;
+    }
+
+    int fd = open(AuditPath(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat info;
+    if(fd < 0 || fstat(fd, &info) != 0)
+    {
+        fprintf(stderr, "\e[1;31mOpening %s failed with error: ", AuditPath());
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    if((size_t)info.st_size < AUDIT_HEADER_SIZE)
+    {
+        fprintf(stderr, "\e[1;31m%s is not an audit log!\e[0m\n", AuditPath());
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        fprintf(stderr, "\e[1;31mMapping the audit log failed with error: ");
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        return -1;
+    }
+
+    const struct AUDITHEADER *header  = (const struct AUDITHEADER*)map;
+    const struct AUDITRECORD *records = (const struct AUDITRECORD*)((const char*)map + AUDIT_HEADER_SIZE);
+    if(memcmp(header->magic, AUDIT_MAGIC, sizeof(AUDIT_MAGIC)) != 0
+    || header->recordsize != sizeof(struct AUDITRECORD)
+    || header->capacity == 0
+    || AUDIT_HEADER_SIZE + (size_t)header->capacity * header->recordsize > (size_t)info.st_size)
+    {
+        fprintf(stderr, "\e[1;31m%s is not an audit log!\e[0m\n", AuditPath());
+        munmap(map, info.st_size);
+        return -1;
+    }
+
+    if(!json)
+        printf("sequence\ttime\tuid\tgid\tpid\tpts\tmode\tverdict\tpayload_bytes\tpayload_fnv1a\tcheck_us\tsend_us\tprocesses\tpids\n");
+
+    uint64_t next  = __atomic_load_n(&header->next, __ATOMIC_ACQUIRE);
+    uint64_t first = next > header->capacity ? next - header->capacity : 0;
+    for(uint64_t ticket = first; ticket < next; ticket++)
+    {
+        const struct AUDITRECORD *slot = &records[ticket % header->capacity];
+        struct AUDITRECORD record;
+
+        uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if(sequence != ticket + 1)
+            continue;   // Overwritten, or still being written
+        memcpy(&record, slot, sizeof(record));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence)
+            continue;
+
+        uint32_t checksum = record.checksum;
+        record.checksum = 0;
+        if(Checksum(&record) != checksum)
+            continue;   // Torn by two writers
+
+        PrintRecord(&record, json);
+    }
+
+    munmap(map, info.st_size);
+    return 0;
+}
+
+
+
+static size_t AuditLogSize(void)
+{
+    return AUDIT_HEADER_SIZE + (size_t)AUDIT_CAPACITY * sizeof(struct AUDITRECORD);
+}
+
+
+
+/*
+ * FNV-1a over the record. The sequence is part of it, so a record cannot be
+ * mistaken for one that was written to the same slot one round earlier.
+ */
+static uint32_t Checksum(const struct AUDITRECORD *record)
+{
+    const unsigned char *bytes = (const unsigned char*)record;
+    uint32_t hash = 2166136261U;
+    for(size_t i = 0; i < sizeof(struct AUDITRECORD); i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+
+
+/*
+ * Gives a new audit log its size and header.
+ * Several onpts processes may find a new log at the same time, so this happens under a file lock.
+ */
+static int InitializeHeader(int fd)
+{
+    struct AUDITHEADER header;
+    if(pread(fd, &header, sizeof(header), 0) == sizeof(header) && memcmp(header.magic, AUDIT_MAGIC, sizeof(AUDIT_MAGIC)) == 0)
+        goto check;
+
+    if(flock(fd, LOCK_EX) != 0)
+        return -1;
+    if(pread(fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, AUDIT_MAGIC, sizeof(AUDIT_MAGIC)) != 0)
+    {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, AUDIT_MAGIC, sizeof(AUDIT_MAGIC));
+        header.recordsize = sizeof(struct AUDITRECORD);
+        header.capacity   = AUDIT_CAPACITY;
+        if(ftruncate(fd, AuditLogSize()) != 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+        {
+            fprintf(stderr, "\e[1;31mCreating the audit log failed with error: ");
+            fprintf(stderr, "%s\e[0m\n", strerror(errno));
+            flock(fd, LOCK_UN);
+            return -1;
+        }
+    }
+    flock(fd, LOCK_UN);
+
+check:
+    if(header.recordsize != sizeof(struct AUDITRECORD) || header.capacity != AUDIT_CAPACITY)
+    {
+        fprintf(stderr, "\e[1;31m%s was created by a different version of onpts!\e[0m\n", AuditPath());
+        return -1;
+    }
+    return 0;
+}
+
+
+
+static void PrintRecord(const struct AUDITRECORD *record, bool json)
+{
+    static const char *modes[]    = {"unknown", "command", "macro", "follow", "mirror"};
+    static const char *verdicts[] = {"allow", "deny", "bypass", "failed"};
+    const char *mode    = record->mode    < 5 ? modes[record->mode]       : "unknown";
+    const char *verdict = record->verdict < 4 ? verdicts[record->verdict] : "unknown";
+
+    char timestamp[64];
+    time_t seconds = record->time / 1000000000LL;
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+    size_t length = strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &utc);
+    snprintf(timestamp + length, sizeof(timestamp) - length, ".%06lldZ", (long long)(record->time % 1000000000LL) / 1000);
+
+    uint32_t numpids = record->numprocs < AUDIT_MAX_PIDS ? record->numprocs : AUDIT_MAX_PIDS;
+    if(json)
+    {
+        printf("{\"sequence\": %llu, \"time\": \"%s\", \"uid\": %u, \"gid\": %u, \"pid\": %d, \"pts\": %d, ",
+                (unsigned long long)record->sequence, timestamp, record->uid, record->gid, record->pid, record->ptsnum);
+        printf("\"mode\": \"%s\", \"verdict\": \"%s\", \"payload_bytes\": %llu, \"payload_fnv1a\": \"%016llx\", ",
+                mode, verdict, (unsigned long long)record->payloadsize, (unsigned long long)record->payloadhash);
+        printf("\"check_us\": %llu, \"send_us\": %llu, \"processes\": %u, \"pids\": [",
+                (unsigned long long)record->checkns / 1000, (unsigned long long)record->sendns / 1000, record->numprocs);
+        for(uint32_t i = 0; i < numpids; i++)
+            printf("%s%d", i ? ", " : "", record->procs[i]);
+        printf("]}\n");
+    }
+    else
+    {
+        printf("%llu\t%s\t%u\t%u\t%d\t%d\t%s\t%s\t%llu\t%016llx\t%llu\t%llu\t%u\t",
+                (unsigned long long)record->sequence, timestamp, record->uid, record->gid, record->pid, record->ptsnum,
+                mode, verdict, (unsigned long long)record->payloadsize, (unsigned long long)record->payloadhash,
+                (unsigned long long)record->checkns / 1000, (unsigned long long)record->sendns / 1000, record->numprocs);
+        for(uint32_t i = 0; i < numpids; i++)
+            printf("%s%d", i ? "," : "", record->procs[i]);
+        printf("\n");
+    }
+}
+
+// vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
@@ -0,0 +1,94 @@
+/*
+ * onpts is a too to securely access the input buffer of other pseudo terminals
+ * Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ONPTS_AUDIT_H
+#define ONPTS_AUDIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sec.h"
+
+#ifndef AUDIT_PATH
+#define AUDIT_PATH      "/var/log/onpts/audit.ring" // Can be changed at build time
+#endif
+#ifndef AUDIT_CAPACITY
+#define AUDIT_CAPACITY  16384   // Records in the ring, older ones get overwritten
+#endif
+#define AUDIT_SYNC_INTERVAL_MS  1000    // The log gets written back to disk at most this often
+#define AUDIT_HEADER_SIZE       4096
+#define AUDIT_MAX_PIDS          46
+#define AUDIT_MAGIC             "ONPTSA1"
+#define AUDIT_BUSY              (1ULL << 63)
+
+#define AUDIT_MODE_COMMAND  1
+#define AUDIT_MODE_MACRO    2
+#define AUDIT_MODE_FOLLOW   3
+#define AUDIT_MODE_MIRROR   4
+
+#define AUDIT_VERDICT_ALLOW     0
+#define AUDIT_VERDICT_DENY      1
+#define AUDIT_VERDICT_BYPASS    2   // Called by root, there was no check
+#define AUDIT_VERDICT_FAILED    3   // Allowed, but sending failed
+
+/*
+ * First page of the audit log
+ */
+struct AUDITHEADER
+{
+    char     magic[8];
+    uint32_t recordsize;
+    uint32_t capacity;
+    uint64_t next;          // Number of records ever appended, the next one goes to next % capacity
+    int64_t  lastsync;      // CLOCK_MONOTONIC in ns
+};
+
+/*
+ * One injection. The records follow the header, each has 256 bytes.
+ */
+struct AUDITRECORD
+{
+    uint64_t sequence;      // Number of the record + 1, AUDIT_BUSY is set while it gets written
+    int64_t  time;          // CLOCK_REALTIME in ns
+    uint32_t uid;
+    uint32_t gid;
+    int32_t  pid;
+    int16_t  ptsnum;
+    uint8_t  mode;
+    uint8_t  verdict;
+    uint64_t payloadsize;   // Bytes sent
+    uint64_t payloadhash;   // FNV-1a of the bytes sent
+    uint64_t checkns;       // Time of the privilege check
+    uint64_t sendns;        // Time of sending the payload
+    uint32_t numprocs;      // Processes checked, procs has the first AUDIT_MAX_PIDS of them
+    uint32_t checksum;      // FNV-1a of the whole record, with checksum = 0
+    int32_t  procs[AUDIT_MAX_PIDS];
+};
+
+const char *AuditPath(void);
+int  AuditOpen(void);
+void AuditBegin(struct AUDITRECORD *record, uint8_t mode, const char *ptspath);
+void AuditProcesses(struct AUDITRECORD *record, const struct CHECKTRACE *trace);
+void AuditCapture(struct AUDITRECORD *record);
+void AuditSentBytes(const char *bytes, size_t length);
+int  AuditWrite(struct AUDITRECORD *record);
+long long AuditClock(void);
+int  ExportAudit(const char *format);
+
+#endif
+
+// vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
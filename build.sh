@@ -1,8 +1,9 @@
 #!/usr/bin/env bash
 
-SOURCE=$(find . -type f -name "*.c")
+# ./tools contains separate programs, see tools/build.sh
+SOURCE=$(find . -path ./tools -prune -o -type f -name "*.c" -print)
 HEADER="-I. -I./fein"
-LIBS="-L."
+LIBS="-L. -lpthread"
 
 for c in $SOURCE ;
 do    
@@ -14,7 +15,7 @@ do
 done
 
 
-OBJECTS=$(find . -type f -name "*.o")
+OBJECTS=$(find . -path ./tools -prune -o -type f -name "*.o" -print)
 
 echo -e "\e[1;34mLinking …\e[0m"
 clang -o onpts $OBJECTS $LIBS
@@ -0,0 +1,193 @@
+/*
+ * onpts is a too to securely access the input buffer of other pseudo terminals
+ * Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "proc.h"
+#include "sec.h"
+#include "explain.h"
+
+static void PrintJSON(int ptsnum, const struct CHECKTRACE *trace, int verdict, uid_t uid, gid_t gid, bool details);
+static void PrintDOT(int ptsnum, const struct CHECKTRACE *trace, int verdict, uid_t uid, gid_t gid, bool details);
+
+
+/*
+ * This function runs the privilege check for a PTS and prints every process it visited:
+ * How it was reached, its IDs, how long reading its /proc files took and
+ * which process caused the denial.
+ * Nothing gets written to the PTS.
+ *
+ * The check always compares against the callers IDs.
+ * For root, onpts would skip the check. This gets noted in the output.
+ *
+ * The check runs as root, so it sees all processes.
+ * The processes only get printed if the caller owns the PTS, or is root.
+ * Everybody else only gets the verdict, which they would get by trying onpts anyway.
+ *
+ * Args:
+ *  ptspath:    path to the PTS
+ *  format:     "json" or "dot"
+ *
+ * Returns:
+ *  0 if access would be allowed, -1 if not or on error
+ */
+int ExplainPrivileges(const char *ptspath, const char *format)
+{
+    bool dot;
+    if(strncmp(format, "json", 10) == 0)
+        dot = false;
+    else if(strncmp(format, "dot", 10) == 0)
+        dot = true;
+    else
+    {
+        fprintf(stderr, "\e[1;31mUnknown format \"%s\" - use json or dot!\e[0m\n", format);
+        return -1;
+    }
+
+    uid_t uid = getuid();
+    gid_t gid = getgid();
+
+    int ptsnum = PTSNumberFromPath(ptspath);
+    struct stat ptsinfo;
+    bool details = uid == 0 || (stat(ptspath, &ptsinfo) == 0 && ptsinfo.st_uid == uid);
+
+    struct CHECKTRACE trace;
+    SetCheckTrace(&trace);
+    int verdict;
+    verdict = CheckPrivileges(ptspath, uid, gid);
+    SetCheckTrace(NULL);
+
+    if(!details)
+        fprintf(stderr, "\e[1;33mOnly the owner of %s and root can see the processes on it\e[0m\n", ptspath);
+    if(dot)
+        PrintDOT(ptsnum, &trace, verdict, uid, gid, details);
+    else
+        PrintJSON(ptsnum, &trace, verdict, uid, gid, details);
+
+    FreeCheckTrace(&trace);
+    if(uid == 0)
+        return 0;
+    return verdict == 0 ? 0 : -1;
+}
+
+
+
+static void PrintJSON(int ptsnum, const struct CHECKTRACE *trace, int verdict, uid_t uid, gid_t gid, bool details)
+{
+    printf("{\n");
+    printf("  \"pts\": \"/dev/pts/%d\",\n", ptsnum);
+    printf("  \"uid\": %u,\n", uid);
+    printf("  \"gid\": %u,\n", gid);
+    printf("  \"verdict\": \"%s\",\n", verdict == 0 ? "allow" : "deny");
+    printf("  \"bypass\": %s,\n", uid == 0 ? "true" : "false");
+    printf("  \"discovery_us\": %lld,\n", trace->discoveryns / 1000);
+    printf("  \"total_us\": %lld,\n", trace->totalns / 1000);
+    printf("  \"timed_out\": %s,\n", trace->timedout ? "true" : "false");
+    if(!details)
+    {
+        printf("  \"denied_by\": null,\n");
+        printf("  \"processes\": null\n}\n");
+        return;
+    }
+    if(trace->deniednode >= 0)
+        printf("  \"denied_by\": %d,\n", trace->nodes[trace->deniednode].pid);
+    else
+        printf("  \"denied_by\": null,\n");
+
+    printf("  \"processes\": [");
+    for(size_t i = 0; i < trace->numnodes; i++)
+    {
+        const struct CHECKNODE *node = &trace->nodes[i];
+        printf("%s\n    {\"pid\": %d, ", i ? "," : "", node->pid);
+        if(node->parent >= 0)
+            printf("\"parent\": %d, ", trace->nodes[node->parent].pid);
+        else
+            printf("\"parent\": null, ");
+        if(node->nspid)
+            printf("\"ns_pid\": %d, ", node->nspid);
+        else
+            printf("\"ns_pid\": null, ");
+        printf("\"via\": \"%s\", ", node->via);
+        if(node->tid)
+            printf("\"task\": %d, ", node->tid);
+        if(node->hasuid)
+            printf("\"uid\": [%u, %u, %u, %u], ", node->uid[0], node->uid[1], node->uid[2], node->uid[3]);
+        else
+            printf("\"uid\": null, ");
+        if(node->hasgid)
+            printf("\"gid\": [%u, %u, %u, %u], ", node->gid[0], node->gid[1], node->gid[2], node->gid[3]);
+        else
+            printf("\"gid\": null, ");
+        printf("\"status_us\": %lld, ", node->statusns / 1000);
+        printf("\"self_us\": %lld, ", (node->totalns - node->childrenns) / 1000);
+        printf("\"subtree_us\": %lld, ", node->totalns / 1000);
+        printf("\"denied\": %s}", node->denied ? "true" : "false");
+    }
+    printf("\n  ]\n}\n");
+}
+
+
+
+static void PrintDOT(int ptsnum, const struct CHECKTRACE *trace, int verdict, uid_t uid, gid_t gid, bool details)
+{
+    printf("digraph onpts {\n");
+    printf("  node [shape=box, fontname=monospace];\n");
+    printf("  pts [label=\"/dev/pts/%d\\nuid %u gid %u\\n%s%s\\n%lldus (discovery %lldus)\", shape=ellipse, color=%s];\n",
+            ptsnum, uid, gid,
+            verdict == 0 ? "allow" : "deny",
+            uid == 0 ? " (root bypasses the check)" : trace->timedout ? " (timed out)" : "",
+            trace->totalns / 1000, trace->discoveryns / 1000,
+            verdict == 0 ? "green" : "red");
+
+    for(size_t i = 0; i < trace->numnodes && details; i++)
+    {
+        const struct CHECKNODE *node = &trace->nodes[i];
+        if(node->nspid && node->nspid != node->pid)
+            printf("  n%zu [label=\"%d (ns %d)\\n", i, node->pid, node->nspid);
+        else
+            printf("  n%zu [label=\"%d\\n", i, node->pid);
+        if(node->hasuid)
+            printf("uid %u %u %u %u\\n", node->uid[0], node->uid[1], node->uid[2], node->uid[3]);
+        if(node->hasgid)
+            printf("gid %u %u %u %u\\n", node->gid[0], node->gid[1], node->gid[2], node->gid[3]);
+        if(!node->hasuid && !node->hasgid)
+            printf("status unreadable\\n");
+        printf("status %lldus, self %lldus\"", node->statusns / 1000, (node->totalns - node->childrenns) / 1000);
+        if(node->denied || !node->hasuid || !node->hasgid)
+            printf(", color=red, penwidth=2");
+        printf("];\n");
+
+        if(node->parent >= 0)
+        {
+            if(node->tid)
+                printf("  n%ld -> n%zu [label=\"%s %d\"];\n", node->parent, i, node->via, node->tid);
+            else
+                printf("  n%ld -> n%zu [label=\"%s\"];\n", node->parent, i, node->via);
+        }
+        else
+            printf("  pts -> n%zu;\n", i);
+    }
+    printf("}\n");
+}
+
+// vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
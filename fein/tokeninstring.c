@@ -16,6 +16,13 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * CHANGELOG
+ *
+ * 19.10.26 - agent <agent@local>
+ *  - Use strtok_r, so that the callback can use ForEachTokenInString as well
+ */
+
 #include <fein.h>
 #include <stdio.h>
 #include <string.h>
@@ -36,15 +43,16 @@ int ForEachTokenInString(const char *str, const char *delimiters, TokenInStringC
     strcpy(tokens, str);
 
     char *token;
+    char *saveptr;
     int retval = 0;
-    token = strtok(tokens, delimiters);
+    token = strtok_r(tokens, delimiters, &saveptr);
     while(token != NULL)
     {
         retval = TokenInStringCallback(str, delimiters, (const char*)token);
         if(retval < 0)
             break;
 
-        token = strtok(NULL, delimiters);
+        token = strtok_r(NULL, delimiters, &saveptr);
     }
 
     free(tokens);
@@ -0,0 +1,256 @@
+/*
+ * onpts is a too to securely access the input buffer of other pseudo terminals
+ * Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <time.h>
+#include "onpts.h"
+#include "proc.h"
+#include "target.h"
+#include "audit.h"
+#include "lock.h"
+#include "template.h"
+#include "follow.h"
+
+#define FOLLOW_MIN_INTERVAL_MS    50    // Poll interval right after the directory changed
+#define FOLLOW_MAX_INTERVAL_MS  1000    // Poll interval when nothing happens for a while
+#define FOLLOW_DEBOUNCE_MS       250    // A directory must be stable that long before it gets sent
+
+static int  ReadCwd(const char *cwdlink, char *cwd, size_t size);
+static int  SyncTargets(struct TARGET *targets, size_t count, char **sentcwd, const char *cwd);
+static int  SendCd(const struct TARGET *target, const char *cwd);
+static long long Milliseconds(void);
+
+
+/*
+ * This function watches the current working directory of the calling shell
+ * and sends a "cd" command to all targets each time it changes.
+ * It returns when the calling shell exits.
+ *
+ * Polling /proc/$PPID/cwd costs one readlink. The poll interval starts short
+ * after a change and gets doubled each time nothing happened.
+ * A new directory must be stable for FOLLOW_DEBOUNCE_MS, so walking through
+ * several directories in a row results in a single cd on the targets.
+ *
+ * The process table only gets scanned when there is something to send.
+ * The privilege verdict gets reused as long as the processes on a target did not change.
+ * A cd only gets sent when the shell is in the foreground of the target,
+ * so it does not end up in the input of a vim or less session.
+ *
+ * Args:
+ *  targetlist: comma separated list of PTS numbers
+ *
+ * Returns:
+ *  0 when the shell exited, -1 on error
+ */
+int FollowCwd(const char *targetlist)
+{
+    struct TARGET *targets;
+    size_t numtargets;
+    if(ParseTargets(targetlist, &targets, &numtargets))
+        return -1;
+
+    char **sentcwd;     // The directory that was sent to each target
+    sentcwd = (char**)calloc(numtargets, sizeof(char*));
+    if(sentcwd == NULL)
+    {
+        fprintf(stderr, "\e[1;31mAllocating memory failed with error: ");
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        FreeTargets(targets, numtargets);
+        return -1;
+    }
+
+    // getppid is the PID in our own PID namespace, the procfs can belong to another one
+    pid_t shell = getppid();
+    pid_t procshell = ProcParent();
+    if(procshell == 0)
+    {
+        fprintf(stderr, "\e[1;31monpts is not visible in %s - Cannot follow the calling shell!\e[0m\n", ProcRoot());
+        free(sentcwd);
+        FreeTargets(targets, numtargets);
+        return -1;
+    }
+    char  cwdlink[PATH_MAX];
+    snprintf(cwdlink, sizeof(cwdlink), "%s/%d/cwd", ProcRoot(), procshell);
+
+    char cwd[PATH_MAX];
+    char candidate[PATH_MAX] = "";
+    long long candidatetime  = 0;
+    long long interval       = FOLLOW_MIN_INTERVAL_MS;
+    int  retval = 0;
+
+    while(1)
+    {
+        // When the shell exits, onpts gets reparented
+        if(getppid() != shell || ReadCwd(cwdlink, cwd, sizeof(cwd)) != 0)
+            break;
+
+        long long now = Milliseconds();
+        if(strcmp(cwd, candidate) != 0)
+        {
+            strcpy(candidate, cwd);
+            candidatetime = now;
+            interval      = FOLLOW_MIN_INTERVAL_MS;
+        }
+
+        long long stable = now - candidatetime;
+        bool pending = false;
+        for(size_t i = 0; i < numtargets; i++)
+            if(sentcwd[i] == NULL || strcmp(sentcwd[i], candidate) != 0)
+                pending = true;
+
+        if(pending && stable >= FOLLOW_DEBOUNCE_MS)
+        {
+            retval = SyncTargets(targets, numtargets, sentcwd, candidate);
+            if(retval != 0)
+                break;
+        }
+
+        long long sleeptime = interval;
+        if(pending && stable < FOLLOW_DEBOUNCE_MS && FOLLOW_DEBOUNCE_MS - stable < sleeptime)
+            sleeptime = FOLLOW_DEBOUNCE_MS - stable;
+        else if(stable >= FOLLOW_DEBOUNCE_MS)
+            interval = interval * 2 < FOLLOW_MAX_INTERVAL_MS ? interval * 2 : FOLLOW_MAX_INTERVAL_MS;
+
+        usleep(sleeptime * 1000);
+    }
+
+    for(size_t i = 0; i < numtargets; i++)
+        free(sentcwd[i]);
+    free(sentcwd);
+    FreeTargets(targets, numtargets);
+    return retval;
+}
+
+
+
+static int ReadCwd(const char *cwdlink, char *cwd, size_t size)
+{
+    ssize_t length;
+    length = readlink(cwdlink, cwd, size - 1);
+    if(length < 0)
+        return -1;
+    cwd[length] = '\0';
+    return 0;
+}
+
+
+
+/*
+ * Sends cwd to all targets that did not get it yet.
+ * Targets that are denied or busy stay pending and will be tried again with the next poll.
+ *
+ * Returns:
+ *  0 on success, -1 on fatal errors
+ */
+static int SyncTargets(struct TARGET *targets, size_t count, char **sentcwd, const char *cwd)
+{
+    // A directory that got removed cannot be entered
+    const char *deleted = " (deleted)";
+    size_t cwdlength = strlen(cwd);
+    if(cwdlength > strlen(deleted) && strcmp(cwd + cwdlength - strlen(deleted), deleted) == 0)
+        return 0;
+
+    struct PROCTABLE table;
+    if(ScanProcesses(&table, PROC_SCAN_ALL) != 0)
+        return -1;
+
+    int retval;
+    retval = UpdateTargets(targets, count, &table);
+    FreeProcesses(&table);
+    if(retval != 0)
+        return -1;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        if(sentcwd[i] != NULL && strcmp(sentcwd[i], cwd) == 0)
+            continue;
+        if(targets[i].verdict != 0 || !targets[i].shellforeground)
+            continue;
+
+        if(SendCd(&targets[i], cwd) != 0)
+            continue;
+
+        free(sentcwd[i]);
+        sentcwd[i] = strdup(cwd);
+    }
+    return 0;
+}
+
+
+
+static int SendCd(const struct TARGET *target, const char *cwd)
+{
+    char *quoted;
+    quoted = QuoteForShell(cwd);
+    if(quoted == NULL)
+        return -1;
+
+    char *command;
+    if(asprintf(&command, "cd %s\n", quoted) < 0)
+    {
+        free(quoted);
+        return -1;
+    }
+    free(quoted);
+
+    struct AUDITRECORD audit;
+    AuditBegin(&audit, AUDIT_MODE_FOLLOW, target->ptspath);
+    audit.verdict = getuid() == 0 ? AUDIT_VERDICT_BYPASS : AUDIT_VERDICT_ALLOW;
+    long long starttime = AuditClock();
+
+    int ptshandler;
+    int retval = -1;
+    struct PTSLOCK lock;
+    OpenPTSLock(&lock, target->ptspath);
+    // The verdict is only valid for the processes it was computed for.
+    // Waiting for the lock can take a while, so they get compared again afterwards.
+    // If they changed, the cd stays pending until the next poll checked them.
+    if(LockPTS(&lock) == 0 && TargetsChanged(target, 1) == 0 && OpenPTS(target->ptspath, &ptshandler) == 0)
+    {
+        AuditCapture(&audit);
+        retval = SendCommand(ptshandler, command);
+        AuditCapture(NULL);
+        close(ptshandler);
+    }
+    ClosePTSLock(&lock);
+    free(command);
+
+    audit.sendns = AuditClock() - starttime;
+    if(retval != 0)
+        audit.verdict = AUDIT_VERDICT_FAILED;
+    AuditWrite(&audit);
+    return retval;
+}
+
+
+
+static long long Milliseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
@@ -10,6 +10,8 @@ PREFIX=/usr/local
 # sets suid-bit
 install -m 4755 -v -s -g root -o root onpts   -D $PREFIX/bin/onpts
 install -m  644 -v    -g root -o root onpts.1 -D $PREFIX/share/man/man1/onpts.1
+# audit log, see README.md
+install -m  700 -v -d -g root -o root /var/log/onpts
 
 # vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
 
@@ -0,0 +1,517 @@
+/*
+ * onpts is a too to securely access the input buffer of other pseudo terminals
+ * Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pwd.h>
+#include "proc.h"
+#include "list.h"
+
+#define PTS_DIRECTORY "/dev/pts"
+
+/*
+ * One line of the inventory
+ */
+struct PTSENTRY
+{
+    int    ptsnum;
+    uid_t  owner;
+    time_t atime;
+    size_t numprocs;                // number of processes attached to the PTS
+    struct PROCINFO *leader;        // session leader, usually the shell
+    struct PROCINFO *foreground;    // leader of the foreground process group
+    const char *access;             // "yes", "no" or "self" - would CheckPermissions succeed?
+    bool   hidden;                  // Process details are not shown, the caller has no access
+};
+
+static int  ReadPTSEntries(struct PTSENTRY **entries, size_t *count);
+static int  AttachedPTS(const struct PROCINFO *proc, size_t n);
+static int  AnalyzePTSEntries(struct PTSENTRY *entries, size_t numentries, const struct PROCTABLE *table);
+static bool IsCallerPTS(int ptsnum);
+static const char *UserName(uid_t uid);
+static void FormatIdle(char *buffer, size_t size, time_t idle);
+static void PrintTable(const struct PTSENTRY *entries, size_t count);
+static void PrintJSON(const struct PTSENTRY *entries, size_t count);
+static void PrintJSONString(const char *string);
+static int  CompareEntries(const void *a, const void *b);
+
+
+/*
+ * This function prints an inventory of all pseudo terminals in /dev/pts.
+ * All process related information come from a single scan of /proc.
+ *
+ * Args:
+ *  json:   If true, the inventory gets printed as JSON array, otherwise as table
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int ListPTS(bool json)
+{
+    struct PTSENTRY *entries;
+    size_t numentries;
+    if(ReadPTSEntries(&entries, &numentries) != 0)
+        return -1;
+
+    struct PROCTABLE table;
+    if(ScanProcesses(&table, PROC_SCAN_ALL) != 0)
+    {
+        free(entries);
+        return -1;
+    }
+
+    int retval;
+    retval = AnalyzePTSEntries(entries, numentries, &table);
+    if(retval == 0)
+    {
+        if(json)
+            PrintJSON(entries, numentries);
+        else
+            PrintTable(entries, numentries);
+    }
+
+    FreeProcesses(&table);
+    free(entries);
+    return retval;
+}
+
+
+
+/*
+ * Reads all PTS from /dev/pts, including their owner and last access time.
+ * The entries are sorted by their number.
+ */
+static int ReadPTSEntries(struct PTSENTRY **entries, size_t *count)
+{
+    DIR *dp;
+    dp = opendir(PTS_DIRECTORY);
+    if(!dp)
+    {
+        fprintf(stderr, "\e[1;31mopendir(\"%s\"); failed with error: ", PTS_DIRECTORY);
+        fprintf(stderr, "\e[1;31m%s\e[0m\n", strerror(errno));
+        return -1;
+    }
+
+    struct PTSENTRY *list = NULL;
+    size_t numentries = 0;
+    size_t capacity   = 0;
+    struct dirent *entry;
+    while((entry = readdir(dp)) != NULL)
+    {
+        if(!isdigit(entry->d_name[0]))
+            continue;   // ".", ".." and "ptmx"
+
+        struct stat info;
+        if(fstatat(dirfd(dp), entry->d_name, &info, 0) != 0)
+            continue;   // PTS got closed in the meantime
+
+        if(numentries == capacity)
+        {
+            struct PTSENTRY *newlist;
+            capacity = capacity ? capacity * 2 : 64;
+            newlist  = (struct PTSENTRY*)realloc(list, capacity * sizeof(struct PTSENTRY));
+            if(newlist == NULL)
+            {
+                fprintf(stderr, "\e[1;31mAllocating memory for the PTS list failed with error: ");
+                fprintf(stderr, "%s\e[0m\n", strerror(errno));
+                free(list);
+                closedir(dp);
+                return -1;
+            }
+            list = newlist;
+        }
+
+        struct PTSENTRY *pts = &list[numentries++];
+        memset(pts, 0, sizeof(struct PTSENTRY));
+        pts->ptsnum = atoi(entry->d_name);
+        pts->owner  = info.st_uid;
+        pts->atime  = info.st_atime;
+    }
+    closedir(dp);
+
+    qsort(list, numentries, sizeof(struct PTSENTRY), CompareEntries);
+    *entries = list;
+    *count   = numentries;
+    return 0;
+}
+
+
+
+/*
+ * Returns the n-th PTS a process is attached to, starting with its controlling terminal.
+ * Returns -1 if the n-th entry must be skipped.
+ */
+static int AttachedPTS(const struct PROCINFO *proc, size_t n)
+{
+    if(n == 0)
+        return proc->ctty;
+    if(proc->openpts[n - 1] == proc->ctty)
+        return -1;  // Already counted as controlling terminal
+    return proc->openpts[n - 1];
+}
+
+
+
+/*
+ * Assigns the processes to the PTS entries.
+ * Each process gets visited once to fill per-PTS buckets of attached processes.
+ * Then the descendants of each bucket get checked by the same rules CheckPrivileges applies.
+ */
+static int AnalyzePTSEntries(struct PTSENTRY *entries, size_t numentries, const struct PROCTABLE *table)
+{
+    if(numentries == 0)
+        return 0;
+
+    int    maxpts   = entries[numentries - 1].ptsnum;
+    size_t numprocs = table->numprocs;
+
+    size_t *entryindex;     // PTS number → index in entries
+    size_t *firstattached;  // Bucket of entries[i] starts at attached[firstattached[i]]
+    size_t *attached   = NULL;
+    size_t *queue;
+    unsigned int *stamps;   // Marks the processes already visited for one entry
+    entryindex    = (size_t*)malloc((maxpts + 1) * sizeof(size_t));
+    firstattached = (size_t*)calloc(numentries + 1, sizeof(size_t));
+    queue         = (size_t*)malloc((numprocs + 1) * sizeof(size_t));
+    stamps        = (unsigned int*)calloc(numprocs + 1, sizeof(unsigned int));
+
+    if(entryindex != NULL && firstattached != NULL)
+    {
+        for(int i = 0; i <= maxpts; i++)
+            entryindex[i] = numentries;
+        for(size_t i = 0; i < numentries; i++)
+            entryindex[entries[i].ptsnum] = i;
+
+        // Count attached processes of each PTS
+        for(size_t p = 0; p < numprocs; p++)
+        {
+            const struct PROCINFO *proc = &table->procs[p];
+            if(!proc->valid)
+                continue;
+            for(size_t n = 0; n <= proc->numopenpts; n++)
+            {
+                int ptsnum = AttachedPTS(proc, n);
+                if(ptsnum >= 0 && ptsnum <= maxpts && entryindex[ptsnum] < numentries)
+                    firstattached[entryindex[ptsnum]]++;
+            }
+        }
+
+        size_t offset = 0;
+        for(size_t i = 0; i <= numentries; i++)
+        {
+            size_t count = firstattached[i];
+            firstattached[i] = offset;
+            offset += count;
+        }
+        attached = (size_t*)malloc((offset + 1) * sizeof(size_t));
+    }
+
+    if(entryindex == NULL || firstattached == NULL || attached == NULL || queue == NULL || stamps == NULL)
+    {
+        fprintf(stderr, "\e[1;31mAllocating memory for the PTS list failed with error: ");
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        free(entryindex);
+        free(firstattached);
+        free(attached);
+        free(queue);
+        free(stamps);
+        return -1;
+    }
+
+    // Fill the buckets. Afterwards firstattached[i] points to the end of bucket i
+    for(size_t p = 0; p < numprocs; p++)
+    {
+        const struct PROCINFO *proc = &table->procs[p];
+        if(!proc->valid)
+            continue;
+        for(size_t n = 0; n <= proc->numopenpts; n++)
+        {
+            int ptsnum = AttachedPTS(proc, n);
+            if(ptsnum >= 0 && ptsnum <= maxpts && entryindex[ptsnum] < numentries)
+                attached[firstattached[entryindex[ptsnum]]++] = p;
+        }
+    }
+    for(size_t i = numentries; i > 0; i--)
+        firstattached[i] = firstattached[i - 1];
+    firstattached[0] = 0;
+
+    uid_t uid = getuid();
+    gid_t gid = getgid();
+
+    for(size_t e = 0; e < numentries; e++)
+    {
+        struct PTSENTRY *pts   = &entries[e];
+        unsigned int     stamp = e + 1;
+
+        // Attached processes
+        size_t tail = 0;
+        for(size_t a = firstattached[e]; a < firstattached[e + 1]; a++)
+        {
+            struct PROCINFO *proc = &table->procs[attached[a]];
+            if(proc->ctty == pts->ptsnum && proc->pid == proc->sid)
+                pts->leader = proc;
+            if(proc->ctty == pts->ptsnum && pts->foreground == NULL)
+                pts->foreground = FindProcess(table, proc->tpgid);
+            queue[tail++] = attached[a];
+            stamps[attached[a]] = stamp;
+        }
+        pts->numprocs = tail;
+
+        if(IsCallerPTS(pts->ptsnum))
+        {
+            pts->access = "self";
+            continue;
+        }
+        if(uid == 0)
+        {
+            pts->access = "yes";
+            continue;
+        }
+
+        // Attached processes and all their descendants must have the callers privileges
+        pts->access = "yes";
+        for(size_t head = 0; head < tail; head++)
+        {
+            size_t parent = queue[head];
+            if(!HasCredentials(&table->procs[parent], uid, gid))
+            {
+                // onpts scanned /proc as root. What runs on a PTS the caller
+                // cannot access is none of its business (think of hidepid)
+                pts->access     = "no";
+                pts->hidden     = true;
+                pts->leader     = NULL;
+                pts->foreground = NULL;
+                pts->numprocs   = 0;
+                break;
+            }
+            for(size_t c = table->firstchild[parent]; c < table->firstchild[parent + 1]; c++)
+            {
+                size_t child = table->children[c];
+                if(stamps[child] == stamp)
+                    continue;
+                stamps[child]  = stamp;
+                queue[tail++]  = child;
+            }
+        }
+    }
+
+    free(entryindex);
+    free(firstattached);
+    free(attached);
+    free(queue);
+    free(stamps);
+    return 0;
+}
+
+
+
+/*
+ * Same logic as CheckPTS in onpts.c:
+ * A PTS belongs to the caller if one of stdin, stdout or stderr is connected to it.
+ */
+static bool IsCallerPTS(int ptsnum)
+{
+    for(int i = 0; i < 3; i++)
+    {
+        if(!isatty(i))
+            continue;
+
+        const char *path = ttyname(i);
+        if(path != NULL && PTSNumberFromPath(path) == ptsnum)
+            return true;
+    }
+    return false;
+}
+
+
+
+/*
+ * getpwuid is expensive. Terminals usually belong to a few users,
+ * so the last names get cached.
+ */
+#define USERNAME_CACHE_SIZE 16
+static const char *UserName(uid_t uid)
+{
+    static struct
+    {
+        uid_t uid;
+        char  name[33];
+    } cache[USERNAME_CACHE_SIZE];
+    static size_t numcached = 0;
+
+    for(size_t i = 0; i < numcached; i++)
+        if(cache[i].uid == uid)
+            return cache[i].name;
+
+    size_t slot = numcached < USERNAME_CACHE_SIZE ? numcached++ : uid % USERNAME_CACHE_SIZE;
+    struct passwd *pw = getpwuid(uid);
+    cache[slot].uid = uid;
+    if(pw != NULL)
+        snprintf(cache[slot].name, sizeof(cache[slot].name), "%s", pw->pw_name);
+    else
+        snprintf(cache[slot].name, sizeof(cache[slot].name), "%u", uid);
+    return cache[slot].name;
+}
+
+
+
+/*
+ * Formats the idle time like w(1) does it roughly: 42s, 3m, 5h, 2d
+ */
+static void FormatIdle(char *buffer, size_t size, time_t idle)
+{
+    if(idle < 0)
+        idle = 0;
+
+    if(idle < 60)
+        snprintf(buffer, size, "%lds", (long)idle);
+    else if(idle < 60*60)
+        snprintf(buffer, size, "%ldm", (long)idle / 60);
+    else if(idle < 24*60*60)
+        snprintf(buffer, size, "%ldh", (long)idle / (60*60));
+    else
+        snprintf(buffer, size, "%ldd", (long)idle / (24*60*60));
+}
+
+
+
+static void PrintTable(const struct PTSENTRY *entries, size_t count)
+{
+    bool   colors = isatty(fileno(stdout));
+    time_t now    = time(NULL);
+
+    printf("%s%-9s %-12s %-24s %-16s %5s %5s  %s%s\n", colors ? "\e[1;37m" : "",
+            "PTS", "OWNER", "LEADER", "FOREGROUND", "IDLE", "PROCS", "ACCESS", colors ? "\e[0m" : "");
+
+    for(size_t i = 0; i < count; i++)
+    {
+        const struct PTSENTRY *pts = &entries[i];
+        char name[16];
+        char leader[32];
+        char idle[24];
+        char procs[24];
+
+        snprintf(name, sizeof(name), "pts/%d", pts->ptsnum);
+        if(pts->leader)
+            snprintf(leader, sizeof(leader), "%d %s", pts->leader->pid, pts->leader->comm);
+        else
+            snprintf(leader, sizeof(leader), "-");
+        FormatIdle(idle, sizeof(idle), now - pts->atime);
+        if(pts->hidden)
+            snprintf(procs, sizeof(procs), "-");
+        else
+            snprintf(procs, sizeof(procs), "%zu", pts->numprocs);
+
+        const char *color = "";
+        if(colors)
+            color = strcmp(pts->access, "yes") == 0 ? "\e[1;32m" : "\e[1;31m";
+
+        printf("%-9s %-12s %-24s %-16s %5s %5s  %s%s%s\n",
+                name,
+                UserName(pts->owner),
+                leader,
+                pts->foreground ? pts->foreground->comm : "-",
+                idle,
+                procs,
+                color, pts->access, colors ? "\e[0m" : "");
+    }
+}
+
+
+
+static void PrintJSON(const struct PTSENTRY *entries, size_t count)
+{
+    time_t now = time(NULL);
+
+    printf("[");
+    for(size_t i = 0; i < count; i++)
+    {
+        const struct PTSENTRY *pts = &entries[i];
+
+        printf("%s\n  {\"pts\": %d, \"path\": \"%s/%d\", ", i ? "," : "", pts->ptsnum, PTS_DIRECTORY, pts->ptsnum);
+        printf("\"owner\": ");
+        PrintJSONString(UserName(pts->owner));
+        printf(", \"uid\": %u, ", pts->owner);
+
+        printf("\"leader\": ");
+        if(pts->leader)
+        {
+            printf("{\"pid\": %d, \"command\": ", pts->leader->pid);
+            PrintJSONString(pts->leader->comm);
+            printf("}");
+        }
+        else
+            printf("null");
+
+        printf(", \"foreground\": ");
+        if(pts->foreground)
+        {
+            printf("{\"pid\": %d, \"command\": ", pts->foreground->pid);
+            PrintJSONString(pts->foreground->comm);
+            printf("}");
+        }
+        else
+            printf("null");
+
+        printf(", \"idle\": %ld, \"processes\": ", (long)(now - pts->atime));
+        if(pts->hidden)
+            printf("null");
+        else
+            printf("%zu", pts->numprocs);
+        printf(", \"access\": \"%s\"}", pts->access);
+    }
+    printf("\n]\n");
+}
+
+
+
+static void PrintJSONString(const char *string)
+{
+    putchar('"');
+    for(const unsigned char *c = (const unsigned char*)string; *c; c++)
+    {
+        if(*c == '"' || *c == '\\')
+            printf("\\%c", *c);
+        else if(*c < 0x20 || *c == 0x7f)
+            printf("\\u%04x", *c);
+        else
+            putchar(*c);
+    }
+    putchar('"');
+}
+
+
+
+static int CompareEntries(const void *a, const void *b)
+{
+    int ptsa = ((const struct PTSENTRY*)a)->ptsnum;
+    int ptsb = ((const struct PTSENTRY*)b)->ptsnum;
+    return (ptsa > ptsb) - (ptsa < ptsb);
+}
+
+// vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
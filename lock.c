@@ -0,0 +1,616 @@
+/*
+ * onpts is a too to securely access the input buffer of other pseudo terminals
+ * Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <dirent.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "proc.h"
+#include "lock.h"
+
+/*
+ * Each byte gets injected with its own ioctl. When two onpts processes write to the same PTS
+ * at the same time, their bytes get mixed. So writing to a PTS is serialized by a lock file per PTS.
+ *
+ * The processes get the PTS in the order they asked for it:
+ *  1. A process takes a ticket (next++) and enters its PID into the slot of the ticket
+ *  2. It sleeps on the futex "serving" until serving is its ticket
+ *  3. When it is done, it increments serving and wakes up all waiters
+ * The bookkeeping is done while holding the flock of the file. It only takes a few microseconds.
+ *
+ * A process holds a byte range lock (F_OFD_SETLK) on its slot while it is in the queue.
+ * The kernel releases it when the process dies. So when the ticket being served has no byte range lock,
+ * its process crashed, and the waiters skip it.
+ * A waiter that gives up marks its slot as abandoned, so that it gets skipped as well.
+ *
+ * The lock files belong to root. When onpts is not installed with the suid bit,
+ * it cannot create them and writes without the lock.
+ */
+
+static long global_timeout = LOCK_TIMEOUT_MS;
+
+static long long Clock(void);
+static int  InitializeLockFile(int fd);
+static int  LockSlot(int fd, uint32_t ticket, short type, int command);
+static bool SlotIsAlive(int fd, uint32_t ticket);
+static void SkipStaleTickets(struct PTSLOCK *lock, bool queued);
+static void WakeWaiters(struct PTSLOCKFILE *file);
+static int  ReadLockFile(const char *name, struct PTSLOCKFILE *file, int *ptsnum);
+static int  CompareLockEntries(const void *a, const void *b);
+static bool MayShowLock(int ptsnum);
+
+
+/*
+ * Returns the directory of the lock files: LOCK_DIRECTORY, or $ONPTS_LOCKDIR for testing.
+ * The environment variable gets ignored when onpts runs with the suid bit set.
+ */
+const char *LockDirectory(void)
+{
+    const char *path = secure_getenv("ONPTS_LOCKDIR");
+    if(path && path[0] != '\0')
+        return path;
+    return LOCK_DIRECTORY;
+}
+
+
+
+void SetLockTimeout(long milliseconds)
+{
+    global_timeout = milliseconds;
+}
+
+
+
+/*
+ * Opens and maps the lock file of a PTS. It gets created if it does not exist.
+ * If there is no lock file, LockPTS and UnlockPTS do nothing.
+ *
+ * Returns:
+ *  0 on success, -1 if there is no lock file
+ */
+int OpenPTSLock(struct PTSLOCK *lock, const char *ptspath)
+{
+    memset(lock, 0, sizeof(struct PTSLOCK));
+    lock->fd     = -1;
+    lock->ptsnum = PTSNumberFromPath(ptspath);
+    if(lock->ptsnum < 0)
+        return -1;
+
+    mkdir(LockDirectory(), 0700);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/pts%d.lock", LockDirectory(), lock->ptsnum);
+    int fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if(fd < 0)
+    {
+#ifdef DEBUG
+        printf("\e[1;34mNo lock for PTS %d: \e[0;36m%s\e[0m\n", lock->ptsnum, strerror(errno));
+#endif
+        return -1;
+    }
+
+    if(InitializeLockFile(fd) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, sizeof(struct PTSLOCKFILE), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED)
+    {
+        fprintf(stderr, "\e[1;31mMapping the lock file of PTS %d failed with error: ", lock->ptsnum);
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    lock->fd   = fd;
+    lock->file = (struct PTSLOCKFILE*)map;
+    return 0;
+}
+
+
+
+void ClosePTSLock(struct PTSLOCK *lock)
+{
+    if(lock->fd < 0)
+        return;
+
+    UnlockPTS(lock);
+    munmap(lock->file, sizeof(struct PTSLOCKFILE));
+    close(lock->fd);
+    lock->fd   = -1;
+    lock->file = NULL;
+}
+
+
+
+/*
+ * Waits until all processes that asked for the PTS before are done with it.
+ * Gives up after the time set by SetLockTimeout.
+ *
+ * Returns:
+ *  0 when the PTS may be written to, -1 on timeout or error
+ */
+int LockPTS(struct PTSLOCK *lock)
+{
+    if(lock->fd < 0 || lock->locked)
+        return 0;
+
+    struct PTSLOCKFILE *file = lock->file;
+    long long starttime = Clock();
+    long long deadline  = starttime + global_timeout * 1000000LL;
+
+    // Take a ticket
+    if(flock(lock->fd, LOCK_EX) != 0)
+    {
+        fprintf(stderr, "\e[1;31mLocking PTS %d failed with error: ", lock->ptsnum);
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        return -1;
+    }
+
+    uint32_t ticket = file->next;
+    if(ticket - file->serving >= LOCK_MAX_WAITERS)
+    {
+        flock(lock->fd, LOCK_UN);
+        fprintf(stderr, "\e[1;31mToo many processes are waiting for PTS %d!\e[0m\n", lock->ptsnum);
+        return -1;
+    }
+    if(LockSlot(lock->fd, ticket, F_WRLCK, F_OFD_SETLK) != 0)
+    {
+        flock(lock->fd, LOCK_UN);
+        fprintf(stderr, "\e[1;31mLocking PTS %d failed with error: ", lock->ptsnum);
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        return -1;
+    }
+
+    struct PTSLOCKSLOT *slot = &file->slots[ticket % LOCK_MAX_WAITERS];
+    slot->ticket    = ticket;
+    slot->pid       = getpid();
+    slot->abandoned = 0;
+    file->next      = ticket + 1;
+    lock->ticket    = ticket;
+    bool contended  = ticket != file->serving;
+    flock(lock->fd, LOCK_UN);
+
+#ifdef DEBUG
+    printf("\e[1;34mPTS %d: \e[0;36mTicket %u, serving %u\e[0m\n", lock->ptsnum, ticket, file->serving);
+#endif
+
+    // Wait for it
+    while(1)
+    {
+        flock(lock->fd, LOCK_EX);
+        SkipStaleTickets(lock, true);
+        uint32_t serving = __atomic_load_n(&file->serving, __ATOMIC_ACQUIRE);
+        if(serving == ticket)
+        {
+            long long now  = Clock();
+            uint64_t  wait = now - starttime;
+            file->holder       = getpid();
+            file->holdersince  = now;
+            file->acquisitions++;
+            file->contended   += contended ? 1 : 0;
+            file->waitns      += wait;
+            if(wait > file->maxwaitns)
+                file->maxwaitns = wait;
+            flock(lock->fd, LOCK_UN);
+
+            lock->locked      = true;
+            lock->lockedsince = now;
+            return 0;
+        }
+        flock(lock->fd, LOCK_UN);
+
+        long long now = Clock();
+        if(now >= deadline)
+            break;
+
+        long long timeout = deadline - now;
+        if(timeout > LOCK_POLL_MS * 1000000LL)
+            timeout = LOCK_POLL_MS * 1000000LL;
+        struct timespec interval;
+        interval.tv_sec  = timeout / 1000000000LL;
+        interval.tv_nsec = timeout % 1000000000LL;
+        syscall(SYS_futex, &file->serving, FUTEX_WAIT, serving, &interval, NULL, 0);
+    }
+
+    // Give up
+    flock(lock->fd, LOCK_EX);
+    slot->abandoned = 1;
+    file->timeouts++;
+    LockSlot(lock->fd, ticket, F_UNLCK, F_OFD_SETLK);
+    SkipStaleTickets(lock, false);
+    flock(lock->fd, LOCK_UN);
+
+    fprintf(stderr, "\e[1;31mPTS %d is busy - Gave up waiting after %ldms!\e[0m\n", lock->ptsnum, global_timeout);
+    return -1;
+}
+
+
+
+/*
+ * Takes the PTS only if no other process writes to it or waits for it.
+ * Nothing gets queued, so this never blocks longer than the bookkeeping takes.
+ * This is for event loops like the one of --mirror, which retry later.
+ *
+ * Returns:
+ *  0 when the PTS may be written to, 1 when it is busy, -1 on error
+ */
+int TryLockPTS(struct PTSLOCK *lock)
+{
+    if(lock->fd < 0 || lock->locked)
+        return 0;
+
+    struct PTSLOCKFILE *file = lock->file;
+    if(flock(lock->fd, LOCK_EX) != 0)
+    {
+        fprintf(stderr, "\e[1;31mLocking PTS %d failed with error: ", lock->ptsnum);
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        return -1;
+    }
+
+    SkipStaleTickets(lock, false);
+    uint32_t ticket = file->next;
+    if(ticket != file->serving)
+    {
+        flock(lock->fd, LOCK_UN);
+        return 1;
+    }
+    if(LockSlot(lock->fd, ticket, F_WRLCK, F_OFD_SETLK) != 0)
+    {
+        flock(lock->fd, LOCK_UN);
+        fprintf(stderr, "\e[1;31mLocking PTS %d failed with error: ", lock->ptsnum);
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        return -1;
+    }
+
+    long long now = Clock();
+    struct PTSLOCKSLOT *slot = &file->slots[ticket % LOCK_MAX_WAITERS];
+    slot->ticket      = ticket;
+    slot->pid         = getpid();
+    slot->abandoned   = 0;
+    file->next        = ticket + 1;
+    file->holder      = getpid();
+    file->holdersince = now;
+    file->acquisitions++;
+    flock(lock->fd, LOCK_UN);
+
+    lock->ticket      = ticket;
+    lock->locked      = true;
+    lock->lockedsince = now;
+    return 0;
+}
+
+
+
+/*
+ * Passes the PTS to the next process in the queue
+ */
+void UnlockPTS(struct PTSLOCK *lock)
+{
+    if(lock->fd < 0 || !lock->locked)
+        return;
+
+    struct PTSLOCKFILE *file = lock->file;
+    flock(lock->fd, LOCK_EX);
+    uint64_t hold = Clock() - lock->lockedsince;
+    file->holdns += hold;
+    if(hold > file->maxholdns)
+        file->maxholdns = hold;
+    file->holder = 0;
+    __atomic_store_n(&file->serving, lock->ticket + 1, __ATOMIC_RELEASE);
+    LockSlot(lock->fd, lock->ticket, F_UNLCK, F_OFD_SETLK);
+    flock(lock->fd, LOCK_UN);
+
+    WakeWaiters(file);
+    lock->locked = false;
+}
+
+
+
+/*
+ * Prints the statistics of all lock files as a table or as JSON.
+ * They show when other users work on their terminals,
+ * so only root gets all of them. Everybody else only gets the PTS they own.
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int PrintLockStats(bool json)
+{
+    DIR *directory = opendir(LockDirectory());
+    if(directory == NULL && errno != ENOENT)
+    {
+        fprintf(stderr, "\e[1;31mopendir(\"%s\"); failed with error: ", LockDirectory());
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        return -1;
+    }
+
+    struct LOCKENTRY
+    {
+        int ptsnum;
+        struct PTSLOCKFILE file;
+    } *entries = NULL;
+    size_t numentries = 0;
+
+    struct dirent *entry;
+    while(directory && (entry = readdir(directory)) != NULL)
+    {
+        if(strncmp(entry->d_name, "pts", 3) != 0)
+            continue;
+
+        struct LOCKENTRY *newentries = realloc(entries, (numentries + 1) * sizeof(struct LOCKENTRY));
+        if(newentries == NULL)
+        {
+            fprintf(stderr, "\e[1;31mAllocating memory for the lock statistics failed with error: ");
+            fprintf(stderr, "%s\e[0m\n", strerror(errno));
+            free(entries);
+            closedir(directory);
+            return -1;
+        }
+        entries = newentries;
+
+        if(ReadLockFile(entry->d_name, &entries[numentries].file, &entries[numentries].ptsnum) == 0
+        && MayShowLock(entries[numentries].ptsnum))
+            numentries++;
+    }
+    if(directory)
+        closedir(directory);
+    qsort(entries, numentries, sizeof(struct LOCKENTRY), CompareLockEntries);
+
+    bool colors = isatty(fileno(stdout));
+    if(json)
+        printf("[");
+    else
+        printf("%s%-9s %7s %7s %9s %9s %8s %6s %10s %10s %10s %10s%s\n", colors ? "\e[1;37m" : "",
+                "PTS", "HOLDER", "WAITING", "ACQUIRED", "CONTENDED", "TIMEOUTS", "STALE",
+                "WAIT(ms)", "MAXWAIT", "HOLD(ms)", "MAXHOLD", colors ? "\e[0m" : "");
+
+    for(size_t i = 0; i < numentries; i++)
+    {
+        const struct PTSLOCKFILE *file = &entries[i].file;
+        uint32_t waiting = file->next - file->serving - (file->holder ? 1 : 0);
+        double   avgwait = file->acquisitions ? file->waitns / (double)file->acquisitions / 1e6 : 0.0;
+        double   avghold = file->acquisitions ? file->holdns / (double)file->acquisitions / 1e6 : 0.0;
+
+        if(json)
+        {
+            printf("%s\n  {\"pts\": %d, \"holder\": %d, \"waiting\": %u, ", i ? "," : "", entries[i].ptsnum,
+                    file->holder, waiting);
+            printf("\"acquisitions\": %llu, \"contended\": %llu, \"timeouts\": %llu, \"stale\": %llu, ",
+                    (unsigned long long)file->acquisitions, (unsigned long long)file->contended,
+                    (unsigned long long)file->timeouts, (unsigned long long)file->stale);
+            printf("\"wait_ms\": %.3f, \"max_wait_ms\": %.3f, \"hold_ms\": %.3f, \"max_hold_ms\": %.3f}",
+                    avgwait, file->maxwaitns / 1e6, avghold, file->maxholdns / 1e6);
+            continue;
+        }
+
+        char name[16];
+        char holder[16];
+        snprintf(name, sizeof(name), "pts/%d", entries[i].ptsnum);
+        if(file->holder)
+            snprintf(holder, sizeof(holder), "%d", file->holder);
+        else
+            snprintf(holder, sizeof(holder), "-");
+
+        printf("%-9s %7s %7u %9llu %9llu %8llu %6llu %10.3f %10.3f %10.3f %10.3f\n",
+                name, holder, waiting,
+                (unsigned long long)file->acquisitions, (unsigned long long)file->contended,
+                (unsigned long long)file->timeouts, (unsigned long long)file->stale,
+                avgwait, file->maxwaitns / 1e6, avghold, file->maxholdns / 1e6);
+    }
+    if(json)
+        printf("\n]\n");
+
+    free(entries);
+    return 0;
+}
+
+
+
+static long long Clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+
+/*
+ * Creates the content of a new lock file.
+ * Two processes may open the file at the same time, so this is done while holding its flock.
+ */
+static int InitializeLockFile(int fd)
+{
+    if(flock(fd, LOCK_EX) != 0)
+        return -1;
+
+    int retval = 0;
+    struct stat info;
+    if(fstat(fd, &info) != 0)
+        retval = -1;
+    else if((size_t)info.st_size < sizeof(struct PTSLOCKFILE))
+    {
+        struct PTSLOCKFILE file;
+        memset(&file, 0, sizeof(file));
+        memcpy(file.magic, LOCK_MAGIC, sizeof(LOCK_MAGIC));
+        if(pwrite(fd, &file, sizeof(file), 0) != sizeof(file))
+            retval = -1;
+    }
+    else
+    {
+        char magic[sizeof(LOCK_MAGIC)];
+        if(pread(fd, magic, sizeof(magic), 0) != sizeof(magic) || memcmp(magic, LOCK_MAGIC, sizeof(magic)) != 0)
+            retval = -1;
+    }
+
+    flock(fd, LOCK_UN);
+    return retval;
+}
+
+
+
+/*
+ * Sets, releases or tests the byte range lock of a ticket.
+ * It covers the first byte of the slot of the ticket.
+ */
+static int LockSlot(int fd, uint32_t ticket, short type, int command)
+{
+    struct flock range;
+    memset(&range, 0, sizeof(range));
+    range.l_type   = type;
+    range.l_whence = SEEK_SET;
+    range.l_start  = offsetof(struct PTSLOCKFILE, slots) + (ticket % LOCK_MAX_WAITERS) * sizeof(struct PTSLOCKSLOT);
+    range.l_len    = 1;
+    return fcntl(fd, command, &range);
+}
+
+
+
+/*
+ * Returns true if a process holds the byte range lock of the ticket.
+ * Own locks do not count, so this must not be called for the own ticket.
+ */
+static bool SlotIsAlive(int fd, uint32_t ticket)
+{
+    struct flock range;
+    memset(&range, 0, sizeof(range));
+    range.l_type   = F_WRLCK;
+    range.l_whence = SEEK_SET;
+    range.l_start  = offsetof(struct PTSLOCKFILE, slots) + (ticket % LOCK_MAX_WAITERS) * sizeof(struct PTSLOCKSLOT);
+    range.l_len    = 1;
+    if(fcntl(fd, F_OFD_GETLK, &range) != 0)
+        return true;    // Better wait than write at the same time
+    return range.l_type != F_UNLCK;
+}
+
+
+
+/*
+ * Skips all tickets at the front of the queue whose process gave up or died.
+ * Must be called while holding the flock.
+ *
+ * Args:
+ *  queued: true if the own ticket is still in the queue and must not be skipped
+ */
+static void SkipStaleTickets(struct PTSLOCK *lock, bool queued)
+{
+    struct PTSLOCKFILE *file = lock->file;
+    bool skipped = false;
+
+    while(file->serving != file->next)
+    {
+        uint32_t serving = file->serving;
+        if(queued && serving == lock->ticket)
+            break;
+
+        const struct PTSLOCKSLOT *slot = &file->slots[serving % LOCK_MAX_WAITERS];
+        if(!slot->abandoned && slot->ticket == serving && SlotIsAlive(lock->fd, serving))
+            break;
+
+        if(!slot->abandoned)
+        {
+#ifdef DEBUG
+            printf("\e[1;34mPTS %d: \e[0;36mSkipping ticket %u of the dead process %d\e[0m\n",
+                    lock->ptsnum, serving, slot->pid);
+#endif
+            file->stale++;
+            if(file->holder == slot->pid)
+                file->holder = 0;
+        }
+        __atomic_store_n(&file->serving, serving + 1, __ATOMIC_RELEASE);
+        skipped = true;
+    }
+
+    if(skipped)
+        WakeWaiters(file);
+}
+
+
+
+static void WakeWaiters(struct PTSLOCKFILE *file)
+{
+    syscall(SYS_futex, &file->serving, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+
+
+/*
+ * Reads a copy of a lock file, while holding its flock
+ */
+static int ReadLockFile(const char *name, struct PTSLOCKFILE *file, int *ptsnum)
+{
+    if(sscanf(name, "pts%d.lock", ptsnum) != 1)
+        return -1;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", LockDirectory(), name);
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+
+    flock(fd, LOCK_SH);
+    ssize_t length = pread(fd, file, sizeof(struct PTSLOCKFILE), 0);
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    if(length != sizeof(struct PTSLOCKFILE) || memcmp(file->magic, LOCK_MAGIC, sizeof(LOCK_MAGIC)) != 0)
+        return -1;
+    return 0;
+}
+
+
+
+static int CompareLockEntries(const void *a, const void *b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+
+
+/*
+ * Returns:
+ *  true if the caller is root or owns the PTS
+ */
+static bool MayShowLock(int ptsnum)
+{
+    if(getuid() == 0)
+        return true;
+
+    char path[32];
+    struct stat info;
+    snprintf(path, sizeof(path), "/dev/pts/%d", ptsnum);
+    return stat(path, &info) == 0 && info.st_uid == getuid();
+}
+
+// vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
@@ -0,0 +1,98 @@
+/*
+ * onpts is a too to securely access the input buffer of other pseudo terminals
+ * Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ONPTS_LOCK_H
+#define ONPTS_LOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef LOCK_DIRECTORY
+#define LOCK_DIRECTORY  "/run/onpts"    // Can be changed at build time
+#endif
+#ifndef LOCK_TIMEOUT_MS
+#define LOCK_TIMEOUT_MS 5000            // How long to wait for a PTS another onpts process writes to
+#endif
+#define LOCK_MAX_WAITERS    64
+#define LOCK_POLL_MS        50          // Waiters look for crashed processes in the queue this often
+#define LOCK_MAGIC          "ONPTSL1"
+
+/*
+ * A place in the queue of a PTS
+ */
+struct PTSLOCKSLOT
+{
+    uint32_t ticket;
+    int32_t  pid;
+    uint32_t abandoned;     // 1 if the waiter gave up
+    uint32_t reserved;
+};
+
+/*
+ * Content of /run/onpts/pts$N.lock
+ * Everything except serving may only be accessed while holding the flock of the file.
+ */
+struct PTSLOCKFILE
+{
+    char     magic[8];
+    uint32_t serving;       // Ticket that may write to the PTS, waiters sleep on it (futex)
+    uint32_t next;          // Next ticket to hand out
+    int32_t  holder;        // PID of the process writing to the PTS, 0 if none
+    uint32_t reserved;
+    int64_t  holdersince;   // CLOCK_MONOTONIC in ns
+
+    // Statistics
+    uint64_t acquisitions;
+    uint64_t contended;     // Acquisitions that had to wait for another process
+    uint64_t timeouts;
+    uint64_t stale;         // Processes that died while waiting or writing
+    uint64_t waitns;
+    uint64_t maxwaitns;
+    uint64_t holdns;
+    uint64_t maxholdns;
+
+    struct PTSLOCKSLOT slots[LOCK_MAX_WAITERS];
+};
+
+/*
+ * The lock of one PTS, as seen by one process
+ */
+struct PTSLOCK
+{
+    int       fd;           // -1 if there is no lock file
+    int       ptsnum;
+    struct PTSLOCKFILE *file;
+    uint32_t  ticket;
+    bool      locked;
+    long long lockedsince;
+};
+
+const char *LockDirectory(void);
+void SetLockTimeout(long milliseconds);
+
+int  OpenPTSLock(struct PTSLOCK *lock, const char *ptspath);
+void ClosePTSLock(struct PTSLOCK *lock);
+int  LockPTS(struct PTSLOCK *lock);
+int  TryLockPTS(struct PTSLOCK *lock);
+void UnlockPTS(struct PTSLOCK *lock);
+
+int  PrintLockStats(bool json);
+
+#endif
+
+// vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
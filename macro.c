@@ -0,0 +1,913 @@
+/*
+ * onpts is a too to securely access the input buffer of other pseudo terminals
+ * Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdbool.h>
+#include <pwd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "onpts.h"
+#include "sec.h"
+#include "macro.h"
+
+/*
+ * Macro syntax
+ *
+ *  Everything outside of <…> gets sent as it is.
+ *  <Esc> <Enter> <Tab> <Space> <BS> <Del> <Insert>        Named keys
+ *  <Up> <Down> <Left> <Right> <Home> <End> <PageUp> …
+ *  <F1> … <F12>
+ *  <C-x>                                                   Ctrl + x
+ *  <M-x>                                                   Alt + x
+ *  <lt>                                                    A literal <
+ *  <Key*N>                                                 The key N times
+ *  <rep N> … </rep>                                        Everything in between N times
+ *  <sleep MS> or <sleep Ns>                                Pause
+ *
+ * Names are not case sensitive. A <…> that is none of the above gets sent as it is.
+ *
+ * A macro gets compiled into bytecode (see macro.h) once. Adjacent text and keys
+ * get merged into one MACRO_OP_TEXT instruction that gets sent as one block.
+ */
+
+struct KEY
+{
+    const char *name;
+    const char *bytes;
+};
+
+static const struct KEY global_keys[] =
+{
+    {"Esc",      "\e"},
+    {"Enter",    "\r"},
+    {"CR",       "\r"},
+    {"NL",       "\n"},
+    {"Tab",      "\t"},
+    {"Space",    " "},
+    {"BS",       "\x7f"},
+    {"lt",       "<"},
+    {"Del",      "\e[3~"},
+    {"Insert",   "\e[2~"},
+    {"Up",       "\e[A"},
+    {"Down",     "\e[B"},
+    {"Right",    "\e[C"},
+    {"Left",     "\e[D"},
+    {"Home",     "\e[H"},
+    {"End",      "\e[F"},
+    {"PageUp",   "\e[5~"},
+    {"PageDown", "\e[6~"},
+    {"F1",       "\eOP"},
+    {"F2",       "\eOQ"},
+    {"F3",       "\eOR"},
+    {"F4",       "\eOS"},
+    {"F5",       "\e[15~"},
+    {"F6",       "\e[17~"},
+    {"F7",       "\e[18~"},
+    {"F8",       "\e[19~"},
+    {"F9",       "\e[20~"},
+    {"F10",      "\e[21~"},
+    {"F11",      "\e[23~"},
+    {"F12",      "\e[24~"},
+    {NULL,       NULL}
+};
+
+#define MACRO_MAX_TAG       32  // Longer <…> are never tags
+#define MACRO_INLINE_REPEAT 16  // <Key*N> up to this many bytes get unrolled
+
+struct BUFFER
+{
+    unsigned char *data;
+    size_t         length;
+    size_t         capacity;
+};
+
+struct COMPILER
+{
+    struct BUFFER code;
+    struct BUFFER text;     // Bytes for the next MACRO_OP_TEXT
+    int           depth;    // Open <rep> blocks
+};
+
+static int  ParseTag(struct COMPILER *compiler, const char *tag, size_t taglength);
+static int  ParseKey(const char *name, char *bytes);
+static bool ParseCount(const char *str, unsigned long max, unsigned long *count);
+static int  Append(struct BUFFER *buffer, const void *data, size_t length);
+static int  AppendNumber(struct BUFFER *buffer, unsigned long number);
+static int  FlushText(struct COMPILER *compiler);
+static bool ReadNumber(const unsigned char *code, size_t length, size_t *pc, unsigned long *number);
+static int  VerifyMacro(const struct MACRO *macro, bool verbose);
+static int  LoadMacroFileAsCaller(const char *path, struct MACRO *macro);
+static int  LoadMacroImage(const char *data, size_t length, const struct stat *source, struct MACRO *macro);
+static void SaveMacroImage(const char *cachepath, const struct stat *source, const struct MACRO *macro);
+static char *MacroCachePath(const char *path);
+static int  ReadWholeFile(const char *path, char **data, ssize_t *length);
+
+
+/*
+ * Compiles a macro into bytecode.
+ * A macro may not send more than MACRO_MAX_OUTPUT bytes
+ * and not sleep longer than MACRO_MAX_SLEEPSUM in total.
+ *
+ * Args:
+ *  source:         The macro
+ *  sourcelength:   Length of the macro in bytes
+ *  macro:          Gets the bytecode. Must be freed with FreeMacro.
+ *
+ * Returns:
+ *  0 on success, -1 if the macro has errors. An error message gets printed in that case.
+ */
+int CompileMacro(const char *source, size_t sourcelength, struct MACRO *macro)
+{
+    struct COMPILER compiler;
+    memset(&compiler, 0, sizeof(compiler));
+
+    int retval = 0;
+    size_t i = 0;
+    while(i < sourcelength && retval == 0)
+    {
+        if(source[i] == '<')
+        {
+            const char *tagend = memchr(&source[i + 1], '>', sourcelength - i - 1);
+            if(tagend)
+            {
+                size_t taglength = tagend - &source[i + 1];
+                int tag = ParseTag(&compiler, &source[i + 1], taglength);
+                if(tag < 0)
+                {
+                    fprintf(stderr, "\e[1;31mIn macro at column %zu: <%.*s>\e[0m\n", i + 1, (int)taglength, &source[i + 1]);
+                    retval = -1;
+                    break;
+                }
+                if(tag > 0)
+                {
+                    i += taglength + 2;
+                    continue;
+                }
+            }
+        }
+        retval = Append(&compiler.text, &source[i], 1);
+        i++;
+    }
+
+    if(retval == 0 && compiler.depth > 0)
+    {
+        fprintf(stderr, "\e[1;31mMacro error: <rep> without </rep>!\e[0m\n");
+        retval = -1;
+    }
+    if(retval == 0)
+        retval = FlushText(&compiler);
+    if(retval == 0)
+    {
+        struct MACRO compiled = {compiler.code.data, compiler.code.length};
+        retval = VerifyMacro(&compiled, true);
+    }
+
+    free(compiler.text.data);
+    if(retval != 0)
+    {
+        free(compiler.code.data);
+        return -1;
+    }
+
+    macro->code   = compiler.code.data;
+    macro->length = compiler.code.length;
+    return 0;
+}
+
+
+
+/*
+ * Loads a macro from a file.
+ * The file can contain a macro, or a compiled macro (starting with MACRO_MAGIC).
+ * Compiled macros get cached in $XDG_CACHE_HOME/onpts (or ~/.cache/onpts),
+ * so the next run only needs to load the bytecode, as long as the file did not change.
+ *
+ * onpts may run with the suid bit set.
+ * All files get accessed with the privileges of the calling user.
+ *
+ * Returns:
+ *  0 on success, -1 on error. An error message gets printed in that case.
+ */
+int LoadMacroFile(const char *path, struct MACRO *macro)
+{
+    if(DropPrivileges() != 0)
+        return -1;
+
+    int retval;
+    retval = LoadMacroFileAsCaller(path, macro);
+
+    if(RegainPrivileges() != 0)
+    {
+        if(retval == 0)
+            FreeMacro(macro);
+        return -1;
+    }
+    return retval;
+}
+
+
+
+/*
+ * Runs the bytecode of a macro.
+ * The bytecode must be verified (CompileMacro and LoadMacroFile do this).
+ *
+ * While the macro sleeps, other onpts processes may write to the PTS.
+ * The processes on the PTS can change in that time,
+ * so after each sleep the lock gets taken again and the permissions get checked again
+ * before the next bytes get sent.
+ *
+ * Args:
+ *  ptshandler: The open PTS
+ *  macro:      The bytecode
+ *  ptspath:    Path of the PTS, for CheckPermissions
+ *  lock:       The lock of the PTS. It must be held when RunMacro gets called.
+ *
+ * Returns:
+ *  0 on success, -1 if sending to the PTS failed, 1 if the access got denied after a sleep
+ */
+int RunMacro(int ptshandler, const struct MACRO *macro, const char *ptspath, struct PTSLOCK *lock)
+{
+    struct
+    {
+        size_t        body;         // First instruction of the block
+        unsigned long remaining;
+    } loops[MACRO_MAX_DEPTH];
+    int depth = 0;
+
+    const unsigned char *code = macro->code;
+    size_t pc = 0;
+    while(pc < macro->length)
+    {
+        unsigned char opcode  = code[pc++];
+        unsigned long operand = 0;
+        if(opcode != MACRO_OP_END)
+            ReadNumber(code, macro->length, &pc, &operand);
+
+        switch(opcode)
+        {
+            case MACRO_OP_TEXT:
+#ifdef DEBUG
+                printf("\e[1;34mSending \e[0;36m%lu\e[1;34m bytes\e[0m\n", operand);
+#endif
+                if(SendBytes(ptshandler, (const char*)&code[pc], operand))
+                    return -1;
+                pc += operand;
+                break;
+
+            case MACRO_OP_SLEEP:
+            {
+                if(operand == 0)
+                    break;
+
+                struct timespec duration;
+                duration.tv_sec  = operand / 1000;
+                duration.tv_nsec = (operand % 1000) * 1000000L;
+                UnlockPTS(lock);
+                while(nanosleep(&duration, &duration) != 0 && errno == EINTR)
+                    ;
+                if(LockPTS(lock))
+                    return -1;
+                if(CheckPermissions(ptspath))
+                {
+                    fprintf(stderr, "\e[1;31mAccess to %s got denied while the macro was sleeping!\e[0m\n", ptspath);
+                    return 1;
+                }
+                break;
+            }
+
+            case MACRO_OP_REPEAT:
+                loops[depth].body      = pc;
+                loops[depth].remaining = operand;
+                depth++;
+                break;
+
+            case MACRO_OP_END:
+                if(--loops[depth - 1].remaining > 0)
+                    pc = loops[depth - 1].body;
+                else
+                    depth--;
+                break;
+        }
+    }
+    return 0;
+}
+
+
+
+void FreeMacro(struct MACRO *macro)
+{
+    if(macro == NULL)
+        return;
+    free(macro->code);
+    macro->code   = NULL;
+    macro->length = 0;
+}
+
+
+
+/*
+ * Compiles the content of one <…>.
+ *
+ * Returns:
+ *  1 if it was a tag, 0 if it is no tag and gets sent as it is, -1 on error
+ */
+static int ParseTag(struct COMPILER *compiler, const char *tag, size_t taglength)
+{
+    if(taglength == 0 || taglength >= MACRO_MAX_TAG)
+        return 0;
+
+    char name[MACRO_MAX_TAG];
+    memcpy(name, tag, taglength);
+    name[taglength] = '\0';
+
+    unsigned long number;
+    if(strncasecmp(name, "rep ", 4) == 0)
+    {
+        if(!ParseCount(&name[4], MACRO_MAX_REPEAT, &number))
+        {
+            fprintf(stderr, "\e[1;31mMacro error: Repeat count must be between 1 and %d!\e[0m\n", MACRO_MAX_REPEAT);
+            return -1;
+        }
+        if(compiler->depth == MACRO_MAX_DEPTH)
+        {
+            fprintf(stderr, "\e[1;31mMacro error: More than %d nested <rep>!\e[0m\n", MACRO_MAX_DEPTH);
+            return -1;
+        }
+        compiler->depth++;
+        if(FlushText(compiler) || Append(&compiler->code, (unsigned char[]){MACRO_OP_REPEAT}, 1) || AppendNumber(&compiler->code, number))
+            return -1;
+        return 1;
+    }
+
+    if(strcasecmp(name, "/rep") == 0)
+    {
+        if(compiler->depth == 0)
+        {
+            fprintf(stderr, "\e[1;31mMacro error: </rep> without <rep>!\e[0m\n");
+            return -1;
+        }
+        compiler->depth--;
+        if(FlushText(compiler) || Append(&compiler->code, (unsigned char[]){MACRO_OP_END}, 1))
+            return -1;
+        return 1;
+    }
+
+    if(strncasecmp(name, "sleep ", 6) == 0)
+    {
+        char *unit;
+        errno  = 0;
+        number = strtoul(&name[6], &unit, 10);
+        if(unit != &name[6] && strcasecmp(unit, "s") == 0)
+            number *= 1000;
+        else if(unit == &name[6] || (*unit != '\0' && strcasecmp(unit, "ms") != 0))
+            number = ULONG_MAX;
+        if(errno != 0 || number > MACRO_MAX_SLEEP)
+        {
+            fprintf(stderr, "\e[1;31mMacro error: Sleep must be a time up to %dms!\e[0m\n", MACRO_MAX_SLEEP);
+            return -1;
+        }
+        if(FlushText(compiler) || Append(&compiler->code, (unsigned char[]){MACRO_OP_SLEEP}, 1) || AppendNumber(&compiler->code, number))
+            return -1;
+        return 1;
+    }
+
+    // <Key> or <Key*N>
+    unsigned long count = 1;
+    char *star = strrchr(name, '*');
+    if(star && star != name && isdigit(star[1]))
+    {
+        if(!ParseCount(&star[1], MACRO_MAX_REPEAT, &count))
+        {
+            fprintf(stderr, "\e[1;31mMacro error: Repeat count must be between 1 and %d!\e[0m\n", MACRO_MAX_REPEAT);
+            return -1;
+        }
+        *star = '\0';
+    }
+
+    char bytes[8];
+    int  length = ParseKey(name, bytes);
+    if(length == 0)
+        return 0;
+
+    if(count * length <= MACRO_INLINE_REPEAT)
+    {
+        for(unsigned long i = 0; i < count; i++)
+            if(Append(&compiler->text, bytes, length))
+                return -1;
+        return 1;
+    }
+
+    if(FlushText(compiler)
+    || Append(&compiler->code, (unsigned char[]){MACRO_OP_REPEAT}, 1) || AppendNumber(&compiler->code, count)
+    || Append(&compiler->text, bytes, length) || FlushText(compiler)
+    || Append(&compiler->code, (unsigned char[]){MACRO_OP_END}, 1))
+        return -1;
+    return 1;
+}
+
+
+
+/*
+ * Looks up the bytes a key sends.
+ *
+ * Returns:
+ *  Number of bytes written to bytes (at most 7), 0 if the name is no key
+ */
+static int ParseKey(const char *name, char *bytes)
+{
+    // <C-x>
+    if(strlen(name) == 3 && tolower(name[0]) == 'c' && name[1] == '-')
+    {
+        char key = name[2];
+        if(isalpha(key))
+            bytes[0] = toupper(key) & 0x1f;
+        else if(strchr("@[\\]^_", key))
+            bytes[0] = key & 0x1f;
+        else if(key == '?')
+            bytes[0] = 0x7f;
+        else
+            return 0;
+        return 1;
+    }
+
+    // <M-x>
+    if(strlen(name) == 3 && tolower(name[0]) == 'm' && name[1] == '-')
+    {
+        bytes[0] = '\e';
+        bytes[1] = name[2];
+        return 2;
+    }
+
+    for(const struct KEY *key = global_keys; key->name; key++)
+    {
+        if(strcasecmp(name, key->name) == 0)
+        {
+            strcpy(bytes, key->bytes);
+            return strlen(key->bytes);
+        }
+    }
+    return 0;
+}
+
+
+
+static bool ParseCount(const char *str, unsigned long max, unsigned long *count)
+{
+    char *end;
+    errno  = 0;
+    *count = strtoul(str, &end, 10);
+    return errno == 0 && end != str && *end == '\0' && isdigit(str[0]) && *count >= 1 && *count <= max;
+}
+
+
+
+static int Append(struct BUFFER *buffer, const void *data, size_t length)
+{
+    if(buffer->length + length > buffer->capacity)
+    {
+        size_t capacity = buffer->capacity ? buffer->capacity : 64;
+        while(capacity < buffer->length + length)
+            capacity *= 2;
+
+        unsigned char *bigger;
+        bigger = (unsigned char*)realloc(buffer->data, capacity);
+        if(bigger == NULL)
+        {
+            fprintf(stderr, "\e[1;31mAllocating memory for the macro failed with error: ");
+            fprintf(stderr, "%s\e[0m\n", strerror(errno));
+            return -1;
+        }
+        buffer->data     = bigger;
+        buffer->capacity = capacity;
+    }
+    memcpy(&buffer->data[buffer->length], data, length);
+    buffer->length += length;
+    return 0;
+}
+
+
+
+/*
+ * Appends a number as unsigned LEB128: 7 bits per byte, the highest bit marks that more bytes follow
+ */
+static int AppendNumber(struct BUFFER *buffer, unsigned long number)
+{
+    unsigned char bytes[8];
+    size_t length = 0;
+    do
+    {
+        bytes[length] = number & 0x7f;
+        number >>= 7;
+        if(number)
+            bytes[length] |= 0x80;
+        length++;
+    } while(number && length < sizeof(bytes));
+    return Append(buffer, bytes, length);
+}
+
+
+
+/*
+ * Turns the collected text into a MACRO_OP_TEXT instruction
+ */
+static int FlushText(struct COMPILER *compiler)
+{
+    if(compiler->text.length == 0)
+        return 0;
+
+    if(Append(&compiler->code, (unsigned char[]){MACRO_OP_TEXT}, 1)
+    || AppendNumber(&compiler->code, compiler->text.length)
+    || Append(&compiler->code, compiler->text.data, compiler->text.length))
+        return -1;
+    compiler->text.length = 0;
+    return 0;
+}
+
+
+
+static bool ReadNumber(const unsigned char *code, size_t length, size_t *pc, unsigned long *number)
+{
+    *number = 0;
+    for(int shift = 0; shift < 32 && *pc < length; shift += 7)
+    {
+        unsigned char byte = code[(*pc)++];
+        *number |= (unsigned long)(byte & 0x7f) << shift;
+        if(!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+
+
+/*
+ * Checks bytecode before it gets run by RunMacro.
+ * Besides the instructions, this checks how many bytes the macro sends
+ * and how long it sleeps, with all repetitions.
+ *
+ * Args:
+ *  macro:      The bytecode
+ *  verbose:    If true, exceeding MACRO_MAX_OUTPUT or MACRO_MAX_SLEEPSUM gets printed as error
+ *
+ * Returns:
+ *  0 if the bytecode is valid, -1 otherwise
+ */
+static int VerifyMacro(const struct MACRO *macro, bool verbose)
+{
+    // Bytes and sleep time of each open <rep> block, for one run of its body.
+    // Level 0 is the whole macro. Each value stays below its limit,
+    // so multiplying it by a repeat count cannot overflow.
+    struct
+    {
+        unsigned long long output;
+        unsigned long long sleep;
+        unsigned long      count;
+    } blocks[MACRO_MAX_DEPTH + 1];
+    memset(&blocks[0], 0, sizeof(blocks[0]));
+
+    const unsigned char *code = macro->code;
+    size_t pc    = 0;
+    int    depth = 0;
+    while(pc < macro->length)
+    {
+        unsigned char opcode = code[pc++];
+        unsigned long operand;
+        if(opcode != MACRO_OP_END && !ReadNumber(code, macro->length, &pc, &operand))
+            return -1;
+
+        switch(opcode)
+        {
+            case MACRO_OP_TEXT:
+                if(operand > macro->length - pc)
+                    return -1;
+                pc += operand;
+                blocks[depth].output += operand;
+                break;
+
+            case MACRO_OP_SLEEP:
+                if(operand > MACRO_MAX_SLEEP)
+                    return -1;
+                blocks[depth].sleep += operand;
+                break;
+
+            case MACRO_OP_REPEAT:
+                if(operand < 1 || operand > MACRO_MAX_REPEAT || depth == MACRO_MAX_DEPTH)
+                    return -1;
+                depth++;
+                memset(&blocks[depth], 0, sizeof(blocks[depth]));
+                blocks[depth].count = operand;
+                break;
+
+            case MACRO_OP_END:
+                if(depth == 0)
+                    return -1;
+                blocks[depth - 1].output += blocks[depth].output * blocks[depth].count;
+                blocks[depth - 1].sleep  += blocks[depth].sleep  * blocks[depth].count;
+                depth--;
+                break;
+
+            default:
+                return -1;
+        }
+
+        if(blocks[depth].output > MACRO_MAX_OUTPUT)
+        {
+            if(verbose)
+                fprintf(stderr, "\e[1;31mMacro error: A macro may send at most %d bytes!\e[0m\n", MACRO_MAX_OUTPUT);
+            return -1;
+        }
+        if(blocks[depth].sleep > MACRO_MAX_SLEEPSUM)
+        {
+            if(verbose)
+                fprintf(stderr, "\e[1;31mMacro error: All sleeps together may take at most %ds!\e[0m\n", MACRO_MAX_SLEEPSUM / 1000);
+            return -1;
+        }
+    }
+    return depth == 0 ? 0 : -1;
+}
+
+
+
+static int LoadMacroFileAsCaller(const char *path, struct MACRO *macro)
+{
+    struct stat source;
+    if(stat(path, &source) != 0)
+    {
+        fprintf(stderr, "\e[1;31mReading macro file %s failed with error: ", path);
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        return -1;
+    }
+
+    char   *data;
+    ssize_t length;
+
+    // Use the cached bytecode if it was compiled from this version of the file
+    char *cachepath = MacroCachePath(path);
+    if(cachepath && ReadWholeFile(cachepath, &data, &length) == 0)
+    {
+        int retval;
+        retval = LoadMacroImage(data, length, &source, macro);
+        free(data);
+        if(retval == 0)
+        {
+#ifdef DEBUG
+            printf("\e[1;34mUsing cached macro \e[0;36m%s\e[0m\n", cachepath);
+#endif
+            free(cachepath);
+            return 0;
+        }
+    }
+
+    if(ReadWholeFile(path, &data, &length) != 0)
+    {
+        fprintf(stderr, "\e[1;31mReading macro file %s failed with error: ", path);
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        free(cachepath);
+        return -1;
+    }
+
+    int retval;
+    if((size_t)length >= sizeof(struct MACROHEADER) && memcmp(data, MACRO_MAGIC, sizeof(MACRO_MAGIC)) == 0)
+    {
+        retval = LoadMacroImage(data, length, NULL, macro);
+        if(retval != 0)
+            fprintf(stderr, "\e[1;31m%s is not a valid compiled macro!\e[0m\n", path);
+    }
+    else
+    {
+        retval = CompileMacro(data, length, macro);
+        if(retval == 0 && cachepath)
+            SaveMacroImage(cachepath, &source, macro);
+    }
+
+    free(data);
+    free(cachepath);
+    return retval;
+}
+
+
+
+/*
+ * Loads the bytecode of a compiled macro file.
+ *
+ * Args:
+ *  data:   Content of the file
+ *  length: Length of the file
+ *  source: If not NULL, the macro must have been compiled from this file
+ *  macro:  Gets the bytecode
+ *
+ * Returns:
+ *  0 on success, -1 if the file is invalid or does not match source
+ */
+static int LoadMacroImage(const char *data, size_t length, const struct stat *source, struct MACRO *macro)
+{
+    struct MACROHEADER header;
+    if(length < sizeof(header))
+        return -1;
+    memcpy(&header, data, sizeof(header));
+
+    if(memcmp(header.magic, MACRO_MAGIC, sizeof(MACRO_MAGIC)) != 0)
+        return -1;
+    if(header.codelength != length - sizeof(header))
+        return -1;
+    if(source)
+    {
+        int64_t mtime = (int64_t)source->st_mtim.tv_sec * 1000000000LL + source->st_mtim.tv_nsec;
+        if(header.sourcesize   != (uint64_t)source->st_size
+        || header.sourcemtime  != mtime
+        || header.sourceinode  != (uint64_t)source->st_ino
+        || header.sourcedevice != (uint64_t)source->st_dev)
+            return -1;
+    }
+
+    macro->length = header.codelength;
+    macro->code   = (unsigned char*)malloc(macro->length + 1);
+    if(macro->code == NULL)
+        return -1;
+    memcpy(macro->code, data + sizeof(header), macro->length);
+
+    if(VerifyMacro(macro, false) != 0)
+    {
+        FreeMacro(macro);
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/*
+ * Writes the bytecode into the cache. The file gets replaced atomically.
+ * Failing to write the cache is not an error, the macro just gets compiled again next time.
+ */
+static void SaveMacroImage(const char *cachepath, const struct stat *source, const struct MACRO *macro)
+{
+    struct MACROHEADER header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MACRO_MAGIC, sizeof(MACRO_MAGIC));
+    header.sourcesize   = source->st_size;
+    header.sourcemtime  = (int64_t)source->st_mtim.tv_sec * 1000000000LL + source->st_mtim.tv_nsec;
+    header.sourceinode  = source->st_ino;
+    header.sourcedevice = source->st_dev;
+    header.codelength   = macro->length;
+
+    // Create the cache directory: …/.cache/onpts
+    char *directory = strdup(cachepath);
+    if(directory == NULL)
+        return;
+    *strrchr(directory, '/') = '\0';
+    char *parent = strrchr(directory, '/');
+    if(parent)
+    {
+        *parent = '\0';
+        mkdir(directory, 0700);
+        *parent = '/';
+    }
+    mkdir(directory, 0700);
+    free(directory);
+
+    char *temppath;
+    if(asprintf(&temppath, "%s.XXXXXX", cachepath) < 0)
+        return;
+    int fd = mkstemp(temppath);
+    if(fd < 0)
+    {
+#ifdef DEBUG
+        printf("\e[1;34mCannot cache macro in \e[0;36m%s\e[1;34m: %s\e[0m\n", cachepath, strerror(errno));
+#endif
+        free(temppath);
+        return;
+    }
+
+    bool written;
+    written = write(fd, &header, sizeof(header)) == sizeof(header)
+           && write(fd, macro->code, macro->length) == (ssize_t)macro->length;
+    if(close(fd) != 0 || !written || rename(temppath, cachepath) != 0)
+        unlink(temppath);
+    free(temppath);
+}
+
+
+
+/*
+ * Returns the path of the cached bytecode of a macro file:
+ * $XDG_CACHE_HOME/onpts/$HASH.opm, $HASH is the FNV-1a hash of the real path of the macro file.
+ * The path must be freed by the caller. NULL if there is no cache directory.
+ */
+static char *MacroCachePath(const char *path)
+{
+    char *realfile = realpath(path, NULL);
+    if(realfile == NULL)
+        return NULL;
+
+    uint64_t hash = 14695981039346656037ULL;
+    for(const char *c = realfile; *c; c++)
+    {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ULL;
+    }
+    free(realfile);
+
+    char *cachepath = NULL;
+    const char *cachehome = getenv("XDG_CACHE_HOME");
+    if(cachehome && cachehome[0] == '/')
+    {
+        if(asprintf(&cachepath, "%s/onpts/%016llx.opm", cachehome, (unsigned long long)hash) < 0)
+            cachepath = NULL;
+        return cachepath;
+    }
+
+    struct passwd *user = getpwuid(getuid());
+    if(user == NULL || user->pw_dir == NULL)
+        return NULL;
+    if(asprintf(&cachepath, "%s/.cache/onpts/%016llx.opm", user->pw_dir, (unsigned long long)hash) < 0)
+        cachepath = NULL;
+    return cachepath;
+}
+
+
+
+/*
+ * Reads a whole file with open/read/close.
+ *
+ * Args:
+ *  path:   Path to the file
+ *  data:   Gets a pointer to the content, terminated by '\0'. Must be freed by the caller.
+ *  length: Gets the length of the content in bytes
+ *
+ * Returns:
+ *  0 on success, -1 on error. errno is set in that case.
+ */
+static int ReadWholeFile(const char *path, char **data, ssize_t *length)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+
+    size_t capacity = 4096;
+    size_t size     = 0;
+    char  *buffer   = (char*)malloc(capacity + 1);
+    while(buffer)
+    {
+        ssize_t n = read(fd, buffer + size, capacity - size);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+        {
+            int error = errno;
+            free(buffer);
+            close(fd);
+            errno = error;
+            return -1;
+        }
+        if(n == 0)
+            break;
+
+        size += n;
+        if(size == capacity)
+        {
+            capacity *= 2;
+            char *bigger = (char*)realloc(buffer, capacity + 1);
+            if(bigger == NULL)
+                free(buffer);
+            buffer = bigger;
+        }
+    }
+    close(fd);
+
+    if(buffer == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    buffer[size] = '\0';
+    *data   = buffer;
+    *length = size;
+    return 0;
+}
+
+// vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
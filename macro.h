@@ -0,0 +1,69 @@
+/*
+ * onpts is a too to securely access the input buffer of other pseudo terminals
+ * Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ONPTS_MACRO_H
+#define ONPTS_MACRO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "lock.h"
+
+#define MACRO_MAX_DEPTH     8       // Nesting of <rep N> blocks
+#define MACRO_MAX_REPEAT    65535   // Largest N of <rep N> and <Key*N>
+#define MACRO_MAX_SLEEP     60000   // Longest <sleep> in ms
+#define MACRO_MAX_SLEEPSUM  300000  // Longest all <sleep> of a macro together may pause in ms
+#define MACRO_MAX_OUTPUT    1048576 // Most bytes a macro may send, counting all repetitions
+
+// Instructions of the bytecode. Operands are unsigned LEB128 numbers.
+#define MACRO_OP_TEXT       0x01    // LENGTH BYTES… - send the bytes
+#define MACRO_OP_SLEEP      0x02    // MS            - pause
+#define MACRO_OP_REPEAT     0x03    // COUNT         - run everything up to the matching END COUNT times
+#define MACRO_OP_END        0x04
+
+#define MACRO_MAGIC         "ONPTSM1"
+
+/*
+ * Header of a compiled macro file. The bytecode follows directly.
+ * The source fields identify the file the bytecode was compiled from,
+ * so a cached macro gets compiled again when its source changes.
+ */
+struct MACROHEADER
+{
+    char     magic[8];
+    uint64_t sourcesize;
+    int64_t  sourcemtime;   // in ns
+    uint64_t sourceinode;
+    uint64_t sourcedevice;
+    uint32_t codelength;
+    uint32_t reserved;
+};
+
+struct MACRO
+{
+    unsigned char *code;
+    size_t         length;
+};
+
+int  CompileMacro(const char *source, size_t sourcelength, struct MACRO *macro);
+int  LoadMacroFile(const char *path, struct MACRO *macro);
+int  RunMacro(int ptshandler, const struct MACRO *macro, const char *ptspath, struct PTSLOCK *lock);
+void FreeMacro(struct MACRO *macro);
+
+#endif
+
+// vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
@@ -0,0 +1,571 @@
+/*
+ * onpts is a too to securely access the input buffer of other pseudo terminals
+ * Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include "onpts.h"
+#include "proc.h"
+#include "sec.h"
+#include "target.h"
+#include "audit.h"
+#include "lock.h"
+#include "mirror.h"
+
+#define MIRROR_QUIT_KEY          0x1d   // Ctrl-]
+#define MIRROR_REVALIDATE_MS      250   // Interval of the privilege check while mirroring
+#define MIRROR_FULLSCAN_MS       2000   // Interval of the scan of all processes while mirroring
+#define MIRROR_BUFFER_SIZE       4096
+#define MIRROR_PENDING_MAX      65536   // Bytes held back for a busy target before it gets closed
+
+struct MIRRORSTATE
+{
+    struct TARGET *targets;
+    size_t    numtargets;
+    int      *ptshandlers;      // -1 if the target is not opened
+    size_t   *bytessent;
+    struct AUDITRECORD *audits; // Record of each target for the bytes not written to the audit log yet
+    long long *auditsince;      // Time each record got started, see AuditClock
+    struct PTSLOCK *locks;      // Taken for each batch, so that other onpts processes can write in between
+    char    **pending;          // Bytes not sent yet, because another onpts process writes to the target
+    size_t   *numpending;
+    long long lastfullscan;     // Time of the last scan of all processes in ms
+};
+
+static int  Revalidate(struct MIRRORSTATE *state);
+static bool Forward(struct MIRRORSTATE *state, const char *bytes, size_t length);
+static bool HasPending(const struct MIRRORSTATE *state);
+static void CloseTarget(struct MIRRORSTATE *state, size_t i);
+static void WriteAudits(struct MIRRORSTATE *state, bool final);
+static void PrintStatus(const struct MIRRORSTATE *state);
+static int  EnterRawMode(struct termios *saved);
+static void RestoreTerminal(void);
+static long long Milliseconds(void);
+
+static struct termios global_savedmode;    // Terminal settings before entering raw mode
+
+
+/*
+ * This function forwards everything typed on the calling terminal to all targets,
+ * until Ctrl-] gets pressed.
+ * The calling terminal is in raw mode, so keys like Ctrl-C get forwarded as well.
+ *
+ * A single epoll loop waits for input, the revalidation timer and signals.
+ * Everything that is available on stdin gets read with one read call and forwarded as one batch.
+ * Each byte still needs its own TIOCSTI ioctl per target - there is no way to inject several bytes at once.
+ *
+ * The processes on the targets get checked before each batch gets forwarded,
+ * before held back input gets sent, and every MIRROR_REVALIDATE_MS.
+ * Only the processes that were on the targets and their descendants get read for that.
+ * All processes get scanned when they changed, and every MIRROR_FULLSCAN_MS to find processes
+ * that attached to a target from outside.
+ * CheckPermissions only runs again for a target if its set of processes changed.
+ * A denied target gets closed and does not get any further input until it is allowed again.
+ *
+ * The event loop never waits for another onpts process writing to a target.
+ * The input for a busy target gets held back and sent as soon as the target is free.
+ *
+ * The bytes sent to a target get written to the audit log every MIRROR_REVALIDATE_MS,
+ * so they are in the log even if onpts gets killed. A last record per target gets written at the end.
+ *
+ * Args:
+ *  targetlist: comma separated list of PTS numbers
+ *
+ * Returns:
+ *  0 when the user quit mirroring, -1 on error
+ */
+int Mirror(const char *targetlist)
+{
+    if(!isatty(STDIN_FILENO))
+    {
+        fprintf(stderr, "\e[1;31mMirroring requires stdin to be a terminal!\e[0m\n");
+        return -1;
+    }
+
+    struct MIRRORSTATE state;
+    memset(&state, 0, sizeof(state));
+    if(ParseTargets(targetlist, &state.targets, &state.numtargets))
+        return -1;
+
+    state.ptshandlers = (int*)   malloc(state.numtargets * sizeof(int));
+    state.bytessent   = (size_t*)calloc(state.numtargets, sizeof(size_t));
+    state.audits      = (struct AUDITRECORD*)malloc(state.numtargets * sizeof(struct AUDITRECORD));
+    state.auditsince  = (long long*)malloc(state.numtargets * sizeof(long long));
+    state.locks       = (struct PTSLOCK*)malloc(state.numtargets * sizeof(struct PTSLOCK));
+    state.pending     = (char**) calloc(state.numtargets, sizeof(char*));
+    state.numpending  = (size_t*)calloc(state.numtargets, sizeof(size_t));
+    if(state.ptshandlers == NULL || state.bytessent == NULL || state.audits == NULL || state.auditsince == NULL
+    || state.locks == NULL || state.pending == NULL || state.numpending == NULL)
+    {
+        fprintf(stderr, "\e[1;31mAllocating memory failed with error: ");
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        free(state.ptshandlers);
+        free(state.bytessent);
+        free(state.audits);
+        free(state.auditsince);
+        free(state.locks);
+        free(state.pending);
+        free(state.numpending);
+        FreeTargets(state.targets, state.numtargets);
+        return -1;
+    }
+    for(size_t i = 0; i < state.numtargets; i++)
+    {
+        state.ptshandlers[i] = -1;
+        AuditBegin(&state.audits[i], AUDIT_MODE_MIRROR, state.targets[i].ptspath);
+        state.auditsince[i] = AuditClock();
+        OpenPTSLock(&state.locks[i], state.targets[i].ptspath);
+    }
+
+    // Signals get handled in the epoll loop, so that the terminal always gets restored
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGQUIT);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+
+    int epollfd  = epoll_create1(EPOLL_CLOEXEC);
+    int timerfd  = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    int sigfd    = signalfd(-1, &signals, SFD_CLOEXEC);
+
+    struct itimerspec interval;
+    interval.it_interval.tv_sec  = MIRROR_REVALIDATE_MS / 1000;
+    interval.it_interval.tv_nsec = (MIRROR_REVALIDATE_MS % 1000) * 1000000L;
+    interval.it_value            = interval.it_interval;
+
+    struct epoll_event event;
+    int retval = 0;
+    if(epollfd < 0 || timerfd < 0 || sigfd < 0 || timerfd_settime(timerfd, 0, &interval, NULL) != 0)
+        retval = -1;
+    event.events  = EPOLLIN;
+    event.data.fd = STDIN_FILENO;
+    if(retval == 0 && epoll_ctl(epollfd, EPOLL_CTL_ADD, STDIN_FILENO, &event) != 0)
+        retval = -1;
+    event.data.fd = timerfd;
+    if(retval == 0 && epoll_ctl(epollfd, EPOLL_CTL_ADD, timerfd, &event) != 0)
+        retval = -1;
+    event.data.fd = sigfd;
+    if(retval == 0 && epoll_ctl(epollfd, EPOLL_CTL_ADD, sigfd, &event) != 0)
+        retval = -1;
+    if(retval != 0)
+    {
+        fprintf(stderr, "\e[1;31mSetting up the event loop failed with error: ");
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+    }
+
+    // Check the targets before anything gets sent
+    if(retval == 0)
+        retval = Revalidate(&state);
+
+    bool rawmode = false;
+    if(retval == 0)
+    {
+        retval  = EnterRawMode(&global_savedmode);
+        rawmode = retval == 0;
+    }
+    if(rawmode)
+        SetCheckTimeoutHook(RestoreTerminal);  // A stuck privilege check must not leave the terminal in raw mode
+
+    bool quit = retval != 0;
+    if(!quit)
+    {
+        fprintf(stderr, "\e[1;34mMirroring to %zu PTS - press \e[1;36mCtrl-]\e[1;34m to quit\e[0m\n", state.numtargets);
+        PrintStatus(&state);
+    }
+
+    char buffer[MIRROR_BUFFER_SIZE];
+    while(!quit)
+    {
+        // Held back input gets retried as often as a waiting LockPTS would look at the queue
+        struct epoll_event events[3];
+        int numevents;
+        numevents = epoll_wait(epollfd, events, 3, HasPending(&state) ? LOCK_POLL_MS : -1);
+        if(numevents < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            retval = -1;
+            break;
+        }
+        if(numevents == 0)
+        {
+            // The processes may have changed while the input was held back
+            if(Revalidate(&state) != 0)
+            {
+                retval = -1;
+                break;
+            }
+            if(Forward(&state, NULL, 0))
+                PrintStatus(&state);
+        }
+
+        for(int e = 0; e < numevents && !quit; e++)
+        {
+            if(events[e].data.fd == STDIN_FILENO)
+            {
+                ssize_t length;
+                length = read(STDIN_FILENO, buffer, sizeof(buffer));
+                if(length <= 0)
+                {
+                    quit = true;
+                    break;
+                }
+
+                char *quitkey = memchr(buffer, MIRROR_QUIT_KEY, length);
+                if(quitkey != NULL)
+                {
+                    length = quitkey - buffer;
+                    quit   = true;
+                }
+
+                // Never send to a target with an outdated verdict
+                if(Revalidate(&state) != 0)
+                {
+                    retval = -1;
+                    quit   = true;
+                    break;
+                }
+
+                if(Forward(&state, buffer, length))
+                    PrintStatus(&state);
+            }
+            else if(events[e].data.fd == timerfd)
+            {
+                uint64_t expirations;
+                if(read(timerfd, &expirations, sizeof(expirations)) < 0)
+                    continue;
+                if(Revalidate(&state) != 0)
+                {
+                    retval = -1;
+                    quit   = true;
+                    break;
+                }
+                Forward(&state, NULL, 0);
+                WriteAudits(&state, false);
+                PrintStatus(&state);
+            }
+            else if(events[e].data.fd == sigfd)
+            {
+                quit = true;
+            }
+        }
+    }
+
+    if(rawmode)
+    {
+        SetCheckTimeoutHook(NULL);
+        RestoreTerminal();
+        fprintf(stderr, "\n");
+    }
+
+    for(size_t i = 0; i < state.numtargets; i++)
+    {
+        // Input that is still held back gets sent, now it is fine to wait in the queue.
+        // The processes on the target may have changed while waiting, so they get checked again.
+        if(state.ptshandlers[i] >= 0 && state.numpending[i] > 0 && LockPTS(&state.locks[i]) == 0)
+        {
+            if(CheckPermissions(state.targets[i].ptspath) == 0)
+            {
+                AuditCapture(&state.audits[i]);
+                if(SendBytes(state.ptshandlers[i], state.pending[i], state.numpending[i]) == 0)
+                    state.bytessent[i] += state.numpending[i];
+                AuditCapture(NULL);
+            }
+            else
+            {
+                state.targets[i].verdict = -1;
+                fprintf(stderr, "\e[1;33mDropped the input held back for %s\e[0m\n", state.targets[i].ptspath);
+            }
+            UnlockPTS(&state.locks[i]);
+        }
+        if(state.ptshandlers[i] >= 0)
+            close(state.ptshandlers[i]);
+        ClosePTSLock(&state.locks[i]);
+        free(state.pending[i]);
+    }
+    if(epollfd >= 0)
+        close(epollfd);
+    if(timerfd >= 0)
+        close(timerfd);
+    if(sigfd >= 0)
+        close(sigfd);
+    sigprocmask(SIG_UNBLOCK, &signals, NULL);
+
+    WriteAudits(&state, true);
+
+    free(state.ptshandlers);
+    free(state.bytessent);
+    free(state.audits);
+    free(state.auditsince);
+    free(state.locks);
+    free(state.pending);
+    free(state.numpending);
+    FreeTargets(state.targets, state.numtargets);
+    return retval;
+}
+
+
+
+/*
+ * Scans the processes and updates the verdicts of all targets.
+ * Targets that became denied get closed, targets that became allowed get opened.
+ *
+ * Returns:
+ *  0 on success, -1 on fatal errors
+ */
+static int Revalidate(struct MIRRORSTATE *state)
+{
+    // Usually nothing changed, and looking at the processes on the targets is enough
+    long long now = Milliseconds();
+    if(now - state->lastfullscan < MIRROR_FULLSCAN_MS && TargetsChanged(state->targets, state->numtargets) == 0)
+        return 0;
+
+    struct PROCTABLE table;
+    if(ScanProcesses(&table, PROC_SCAN_ALL) != 0)
+        return -1;
+    state->lastfullscan = Milliseconds();
+
+    int retval;
+    retval = UpdateTargets(state->targets, state->numtargets, &table);
+    FreeProcesses(&table);
+    if(retval != 0)
+        return -1;
+
+    for(size_t i = 0; i < state->numtargets; i++)
+    {
+        bool allowed = state->targets[i].verdict == 0;
+        if(allowed && state->ptshandlers[i] < 0)
+        {
+            if(OpenPTS(state->targets[i].ptspath, &state->ptshandlers[i]) != 0)
+                state->ptshandlers[i] = -1;
+        }
+        else if(!allowed && state->ptshandlers[i] >= 0)
+        {
+            CloseTarget(state, i);
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Sends a batch of bytes to all opened targets.
+ * If another onpts process writes to a target, the bytes get held back and sent with the next call.
+ * A call without bytes only sends what was held back.
+ * A target that fails (for example because it got closed) gets closed as well.
+ * So does a target another onpts process writes to for too long. Revalidate opens it again.
+ *
+ * Returns:
+ *  true if the state of a target changed
+ */
+static bool Forward(struct MIRRORSTATE *state, const char *bytes, size_t length)
+{
+    bool changed = false;
+    for(size_t i = 0; i < state->numtargets; i++)
+    {
+        if(state->ptshandlers[i] < 0)
+            continue;
+
+        bool wasbusy = state->numpending[i] > 0;
+        if(length > 0)
+        {
+            size_t numpending = state->numpending[i];
+            char  *pending    = NULL;
+            if(numpending + length <= MIRROR_PENDING_MAX)
+                pending = (char*)realloc(state->pending[i], numpending + length);
+            if(pending == NULL)
+            {
+                CloseTarget(state, i);
+                changed = true;
+                continue;
+            }
+            memcpy(pending + numpending, bytes, length);
+            state->pending[i]    = pending;
+            state->numpending[i] = numpending + length;
+        }
+        if(state->numpending[i] == 0)
+            continue;
+
+        int retval = TryLockPTS(&state->locks[i]);
+        if(retval == 1)
+        {
+            changed = changed || !wasbusy;
+            continue;   // Busy, try again later
+        }
+        if(retval == 0)
+        {
+            AuditCapture(&state->audits[i]);
+            retval = SendBytes(state->ptshandlers[i], state->pending[i], state->numpending[i]);
+            AuditCapture(NULL);
+            UnlockPTS(&state->locks[i]);
+        }
+        if(retval != 0)
+        {
+            CloseTarget(state, i);
+            changed = true;
+            continue;
+        }
+        state->bytessent[i] += state->numpending[i];
+        state->numpending[i] = 0;
+        changed = true;
+    }
+    return changed;
+}
+
+
+
+static bool HasPending(const struct MIRRORSTATE *state)
+{
+    for(size_t i = 0; i < state->numtargets; i++)
+        if(state->ptshandlers[i] >= 0 && state->numpending[i] > 0)
+            return true;
+    return false;
+}
+
+
+
+/*
+ * Closes a target and drops the input held back for it
+ */
+static void CloseTarget(struct MIRRORSTATE *state, size_t i)
+{
+    close(state->ptshandlers[i]);
+    state->ptshandlers[i] = -1;
+    state->numpending[i]  = 0;
+}
+
+
+
+/*
+ * Writes the records of the targets that got bytes since their last record, and starts new ones.
+ * With final set, every target gets a record, that also has the last verdict of a denied target.
+ */
+static void WriteAudits(struct MIRRORSTATE *state, bool final)
+{
+    for(size_t i = 0; i < state->numtargets; i++)
+    {
+        struct AUDITRECORD *audit = &state->audits[i];
+        if(audit->payloadsize == 0 && !final)
+            continue;
+
+        audit->sendns = AuditClock() - state->auditsince[i];
+        if(audit->payloadsize > 0 || state->targets[i].verdict == 0)
+            audit->verdict = getuid() == 0 ? AUDIT_VERDICT_BYPASS : AUDIT_VERDICT_ALLOW;
+        AuditWrite(audit);
+
+        AuditBegin(audit, AUDIT_MODE_MIRROR, state->targets[i].ptspath);
+        state->auditsince[i] = AuditClock();
+    }
+}
+
+
+
+/*
+ * Redraws the status line: For each target, if input gets forwarded and how many bytes were sent.
+ */
+static void PrintStatus(const struct MIRRORSTATE *state)
+{
+    char   line[1024];
+    size_t length = 0;
+
+    length += snprintf(line + length, sizeof(line) - length, "\r\e[K");
+    for(size_t i = 0; i < state->numtargets && length < sizeof(line); i++)
+    {
+        const char *status;
+        if(state->ptshandlers[i] >= 0 && state->numpending[i] > 0)
+            status = "\e[1;33m… busy";
+        else if(state->ptshandlers[i] >= 0)
+            status = "\e[1;32m✔";
+        else if(state->targets[i].verdict != 0)
+            status = "\e[1;31m✘ denied";
+        else
+            status = "\e[1;31m✘ closed";
+
+        length += snprintf(line + length, sizeof(line) - length, "\e[1;34mpts/%s %s\e[0;36m %zuB\e[0m  ",
+                state->targets[i].ptsnum, status, state->bytessent[i]);
+    }
+    if(length > sizeof(line))
+        length = sizeof(line);
+
+    if(write(STDERR_FILENO, line, length) < 0)
+        return;
+}
+
+
+
+/*
+ * Puts the terminal on stdin into raw mode.
+ * Output processing stays enabled, so that error messages still get printed correctly.
+ */
+static int EnterRawMode(struct termios *saved)
+{
+    if(tcgetattr(STDIN_FILENO, saved) != 0)
+    {
+        fprintf(stderr, "\e[1;31mtcgetattr failed with error: ");
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        return -1;
+    }
+
+    struct termios raw = *saved;
+    cfmakeraw(&raw);
+    raw.c_oflag |= OPOST;
+    if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) != 0)
+    {
+        fprintf(stderr, "\e[1;31mtcsetattr failed with error: ");
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/*
+ * Restores the terminal settings saved by EnterRawMode.
+ * This function is async-signal-safe.
+ */
+static void RestoreTerminal(void)
+{
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &global_savedmode);
+}
+
+
+
+static long long Milliseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
@@ -29,26 +29,39 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include "onpts.h"
 #include "sec.h"
-
-#define VERSION "1.0.1"
+#include "list.h"
+#include "follow.h"
+#include "mirror.h"
+#include "explain.h"
+#include "macro.h"
+#include "audit.h"
+#include "lock.h"
+#include "template.h"
+
+#define VERSION "1.1.0"
 /*
  * CHANGELOG
  *
+ * 1.1.0
+ *  - Adds --list to print an inventory of all PTS, computed from a single parallel scan of /proc
+ *  - Adds --follow-cwd to keep the working directory of other PTS in sync with the calling shell
+ *  - Adds --mirror to forward each keystroke to several PTS in real time
+ *  - Adds --explain to print the process tree the privilege check visited as JSON or DOT
+ *  - Adds --deadline to limit the time of the privilege check. When it runs out, access gets denied
+ *  - Adds -m and --macro-file to send keystroke macros like ":wq<Enter>" or "<C-c><Up><Enter>"
+ *  - Adds an audit log of all injections in a memory mapped ring, --audit exports it
+ *  - Processes writing to the same PTS wait for each other in FIFO order. --wait limits the time, --lock-stats shows the queues
+ *  - Adds -t to fill {cwd}, {env:VAR} and {file:PATH} into the command, quoted for the shell
+ *  - Builds the command in one buffer. The old loop called strcat on uninitialized memory
+ *  - Works inside containers: PIDs get taken from the procfs instead of getpid, IDs not mapped into the user namespace of onpts get denied
+ *  - --follow-cwd and --mirror check all changed PTS with one scan of /proc instead of one scan per PTS
+ *
  * 1.0.1
  *  - Stops appeding an unwanted trailing space to the string that gets send to the remote PTS
  */
 
-int GetPTSPath(char *ptsnum, const char **ptspath);
-int CheckPTS(const char *ptspath);
-int CheckPermissions(const char *ptspath);
-int OpenPTS(const char *ptspath, int *ptshandler);
-int SendCommand(int ptshandler, const char *command);
-int SendStdin(int ptshandler);
-int SendChar(int ptshandler, char byte);
-
-#define MAX_PTS_PATH_LENGTH (sizeof("/dev/pts/XXXX")+1)
-
 void PrintHelp(char *pname)
 {
     fprintf(stderr, "onpts  Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>\n");
@@ -56,10 +69,29 @@ void PrintHelp(char *pname)
     fprintf(stderr, "This is free software, and you are welcome to redistribute it\n");
     fprintf(stderr, "under certain conditions.\n\n");
     fprintf(stderr, "\e[1;31monpts [\e[1;34m%s\e[1;31m]\e[0m\n", VERSION);
-    fprintf(stderr, "\e[1;37mUsage: \e[1;36m%s\e[1;34m [-h|-n] PTS COMMAND\e[0m\n", pname);
+    fprintf(stderr, "\e[1;37mUsage: \e[1;36m%s\e[1;34m [-h|-n|-m|-t] PTS COMMAND\e[0m\n", pname);
+    fprintf(stderr, "\e[1;37m       \e[1;36m%s\e[1;34m --macro-file FILE PTS\e[0m\n", pname);
+    fprintf(stderr, "\e[1;37m       \e[1;36m%s\e[1;34m --list [--json]\e[0m\n", pname);
+    fprintf(stderr, "\e[1;37m       \e[1;36m%s\e[1;34m --follow-cwd PTS[,PTS…]\e[0m\n", pname);
+    fprintf(stderr, "\e[1;37m       \e[1;36m%s\e[1;34m --mirror PTS[,PTS…]\e[0m\n", pname);
+    fprintf(stderr, "\e[1;37m       \e[1;36m%s\e[1;34m --explain json|dot PTS\e[0m\n", pname);
+    fprintf(stderr, "\e[1;37m       \e[1;36m%s\e[1;34m --audit json|tsv\e[0m\n", pname);
+    fprintf(stderr, "\e[1;37m       \e[1;36m%s\e[1;34m --lock-stats [--json]\e[0m\n", pname);
     fprintf(stderr, "\t\e[1;36m-h\t\e[1;34mPrint this Help\e[0m\n");
     fprintf(stderr, "\t\e[1;36m-n\t\e[1;34mNO line break after command (like -n for echo)\e[0m\n");
-    fprintf(stderr, "If data gets piped to stdin, they get send to the other PTS after the strings on the parameter list.\n");
+    fprintf(stderr, "\t\e[1;36m-m\t\e[1;34mCOMMAND is a macro with keys like <Esc>, <C-c>, <Up*3>, <rep N>…</rep>, <sleep MS>\e[0m\n");
+    fprintf(stderr, "\t\e[1;36m-t\t\e[1;34mReplace {cwd}, {env:VAR} and {file:PATH} in COMMAND by their values in single quotes\e[0m\n");
+    fprintf(stderr, "\t\e[1;36m--macro-file\t\e[1;34mSend the macro in FILE. The compiled macro gets cached\e[0m\n");
+    fprintf(stderr, "\t\e[1;36m--list\t\e[1;34mList all PTS with owner, processes and if onpts may access them\e[0m\n");
+    fprintf(stderr, "\t\e[1;36m--json\t\e[1;34mPrint the list or the lock statistics as JSON\e[0m\n");
+    fprintf(stderr, "\t\e[1;36m--follow-cwd\t\e[1;34mSend a cd to the listed PTS whenever the working directory of this shell changes\e[0m\n");
+    fprintf(stderr, "\t\e[1;36m--mirror\t\e[1;34mForward everything typed to the listed PTS until Ctrl-] gets pressed\e[0m\n");
+    fprintf(stderr, "\t\e[1;36m--explain\t\e[1;34mPrint all processes the privilege check visits, and why access gets denied\e[0m\n");
+    fprintf(stderr, "\t\e[1;36m--audit\t\e[1;34mPrint the audit log of all injections (root only)\e[0m\n");
+    fprintf(stderr, "\t\e[1;36m--lock-stats\t\e[1;34mPrint how long processes waited for each PTS you own (root: all PTS)\e[0m\n");
+    fprintf(stderr, "\t\e[1;36m--deadline MS\t\e[1;34mDeny access if the privilege check takes longer than MS milliseconds (default: %d)\e[0m\n", CHECK_DEADLINE_MS);
+    fprintf(stderr, "\t\e[1;36m--wait MS\t\e[1;34mGive up if another onpts process writes to the PTS for longer than MS milliseconds (default: %d)\e[0m\n", LOCK_TIMEOUT_MS);
+    fprintf(stderr, "If data gets piped to stdin (at most 1MiB), they get send to the other PTS after the strings on the parameter list.\n");
 }
 
 
@@ -69,36 +101,152 @@ int main(int argc, char *argv[])
     // Handle Arguments
     int  argi   = 0;
     char *pname = argv[argi++];
-    if(argc == 2)
-    {
-        if(strncmp(argv[1], "-h", 10) == 0 || strncmp(argv[1], "--help", 10) == 0)
-        {
-            PrintHelp(pname);
-            exit(EXIT_SUCCESS);
-        }
-    }
-    if(argc < 3)
-    {
-        fprintf(stderr, "\e[1;31mNot enough arguments!\e[0m\n");
-        PrintHelp(pname);
-        exit(EXIT_FAILURE);
-    }
 
     // Handle optional arguments
     bool opt_nolinebreak   = false;
     bool opt_readfromstdin = false;
+    bool opt_list          = false;
+    bool opt_json          = false;
+    char *opt_followcwd    = NULL;
+    char *opt_mirror       = NULL;
+    char *opt_explain      = NULL;
+    bool opt_macro         = false;
+    bool opt_template      = false;
+    char *opt_macrofile    = NULL;
+    char *opt_audit        = NULL;
+    bool opt_lockstats     = false;
 
     for(; argi < argc; argi++)
     {
         if(argv[argi][0] == '-')
         {
-            if(strncmp(argv[argi], "-n", 10) == 0)
+            if(strncmp(argv[argi], "-h", 10) == 0 || strncmp(argv[argi], "--help", 10) == 0)
+            {
+                PrintHelp(pname);
+                exit(EXIT_SUCCESS);
+            }
+            else if(strncmp(argv[argi], "-n", 10) == 0)
                 opt_nolinebreak = true;
+            else if(strncmp(argv[argi], "-m", 10) == 0 || strncmp(argv[argi], "--macro", 10) == 0)
+                opt_macro = true;
+            else if(strncmp(argv[argi], "-t", 10) == 0 || strncmp(argv[argi], "--template", 20) == 0)
+                opt_template = true;
+            else if(strncmp(argv[argi], "--macro-file", 20) == 0 && argi + 1 < argc)
+                opt_macrofile = argv[++argi];
+            else if(strncmp(argv[argi], "--list", 10) == 0)
+                opt_list = true;
+            else if(strncmp(argv[argi], "--json", 10) == 0)
+                opt_json = true;
+            else if(strncmp(argv[argi], "--follow-cwd", 20) == 0 && argi + 1 < argc)
+                opt_followcwd = argv[++argi];
+            else if(strncmp(argv[argi], "--mirror", 10) == 0 && argi + 1 < argc)
+                opt_mirror = argv[++argi];
+            else if(strncmp(argv[argi], "--explain", 10) == 0 && argi + 1 < argc)
+                opt_explain = argv[++argi];
+            else if(strncmp(argv[argi], "--audit", 10) == 0 && argi + 1 < argc)
+                opt_audit = argv[++argi];
+            else if(strncmp(argv[argi], "--lock-stats", 20) == 0)
+                opt_lockstats = true;
+            else if(strncmp(argv[argi], "--deadline", 20) == 0 && argi + 1 < argc)
+            {
+                char *end;
+                errno = 0;
+                long deadline = strtol(argv[++argi], &end, 10);
+                if(errno != 0 || *end != '\0' || end == argv[argi] || deadline <= 0)
+                {
+                    fprintf(stderr, "\e[1;31mInvalid deadline %s! Expected a positive number of milliseconds.\e[0m\n", argv[argi]);
+                    exit(EXIT_FAILURE);
+                }
+                SetCheckDeadline(deadline);
+            }
+            else if(strncmp(argv[argi], "--wait", 10) == 0 && argi + 1 < argc)
+            {
+                char *end;
+                errno = 0;
+                long timeout = strtol(argv[++argi], &end, 10);
+                if(errno != 0 || *end != '\0' || end == argv[argi] || timeout < 0)
+                {
+                    fprintf(stderr, "\e[1;31mInvalid wait time %s! Expected a number of milliseconds.\e[0m\n", argv[argi]);
+                    exit(EXIT_FAILURE);
+                }
+                SetLockTimeout(timeout);
+            }
+            else
+            {
+                fprintf(stderr, "\e[1;31mUnknown option %s!\e[0m\n", argv[argi]);
+                PrintHelp(pname);
+                exit(EXIT_FAILURE);
+            }
         }
         else
             break;
     }
 
+    // Modes that do not write to a PTS
+    if(opt_list)
+    {
+        if(ListPTS(opt_json))
+            exit(EXIT_FAILURE);
+        exit(EXIT_SUCCESS);
+    }
+    if(opt_followcwd)
+    {
+        if(FollowCwd(opt_followcwd))
+            exit(EXIT_FAILURE);
+        exit(EXIT_SUCCESS);
+    }
+    if(opt_mirror)
+    {
+        if(Mirror(opt_mirror))
+            exit(EXIT_FAILURE);
+        exit(EXIT_SUCCESS);
+    }
+
+    if(opt_lockstats)
+    {
+        if(PrintLockStats(opt_json))
+            exit(EXIT_FAILURE);
+        exit(EXIT_SUCCESS);
+    }
+
+    if(opt_audit)
+    {
+        if(ExportAudit(opt_audit))
+            exit(EXIT_FAILURE);
+        exit(EXIT_SUCCESS);
+    }
+
+    if(opt_explain)
+    {
+        const char *ptspath;
+        if(argi >= argc)
+        {
+            fprintf(stderr, "\e[1;31mNot enough arguments!\e[0m\n");
+            PrintHelp(pname);
+            exit(EXIT_FAILURE);
+        }
+        if(CheckPTSNumber(argv[argi]) || GetPTSPath(argv[argi], &ptspath))
+            exit(EXIT_FAILURE);
+        int retval;
+        retval = ExplainPrivileges(ptspath, opt_explain);
+        free((void*)ptspath);
+        if(retval)
+            exit(EXIT_FAILURE);
+        exit(EXIT_SUCCESS);
+    }
+
+    if(argc - argi < (opt_macrofile ? 1 : 2))
+    {
+        fprintf(stderr, "\e[1;31mNot enough arguments!\e[0m\n");
+        PrintHelp(pname);
+        exit(EXIT_FAILURE);
+    }
+    if(opt_macrofile && argc - argi > 1)
+    {
+        fprintf(stderr, "\e[1;31m--macro-file does not take a COMMAND!\e[0m\n");
+        exit(EXIT_FAILURE);
+    }
+
     // Do I get data from stdin?
     if(!isatty(fileno(stdin)))
         opt_readfromstdin = true;
@@ -106,38 +254,37 @@ int main(int argc, char *argv[])
     // Handle PTS argument
     char *arg_ptsnum = argv[argi++];
     // Check if it is a valid number
-    for(int i=0; arg_ptsnum[i]; i++)
+    if(CheckPTSNumber(arg_ptsnum))
+        exit(EXIT_FAILURE);
+
+    // Handle Command: concatinate cmd and its args, and fill in the placeholders
+    char *arg_command = NULL;
+    if(!opt_macrofile)
     {
-        if(!isdigit(arg_ptsnum[i]) || i >= 4)
-        {
-            fprintf(stderr, "\e[1;31mPTYNUM must be a decimal number between 0 and 9999!\e[0m\n");
+        unsigned int flags = 0;
+        if(opt_template)
+            flags |= TEMPLATE_EXPAND;
+        if(opt_macro)
+            flags |= TEMPLATE_MACRO;    // a macro says <Enter> itself
+        else if(!opt_nolinebreak)
+            flags |= TEMPLATE_LINEBREAK;
+
+        if(BuildCommand(&argv[argi], argc - argi, flags, &arg_command))
             exit(EXIT_FAILURE);
-        }
     }
 
-    // Handle Command
-    char  *arg_command   = NULL;
-    size_t commandlength = 1; // offset of one for "\0"
-
-    // concatinate cmd and its args
-    for(; argi < argc; argi++)
+    // Compile the macro before anything gets sent, so a broken macro sends nothing
+    struct MACRO macro = {NULL, 0};
+    if(opt_macrofile)
     {
-        commandlength += strlen(argv[argi]) + 1; // + " "
-        arg_command    = (char*)realloc((void*)arg_command, commandlength);
-        if(arg_command == NULL)
-        {
-            fprintf(stderr, "\e[1;31mAllocating memory for command argument failed with error: ");
-            fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        if(LoadMacroFile(opt_macrofile, &macro))
+            exit(EXIT_FAILURE);
+    }
+    else if(opt_macro)
+    {
+        if(CompileMacro(arg_command, strlen(arg_command), &macro))
             exit(EXIT_FAILURE);
-        }
-        strcat(arg_command, argv[argi]);
-        strcat(arg_command, " ");
     }
-
-    if(!opt_nolinebreak)
-        arg_command[strlen(arg_command) - 1] = '\n';    // relace last " " with a "\n"
-    else
-        arg_command[strlen(arg_command) - 1] = '\0';    // remove last " "
 
 #ifdef DEBUG
     printf("\e[1;34mpname:     \e[0;36m%s\n", pname);
@@ -155,26 +302,103 @@ int main(int argc, char *argv[])
     if(CheckPTS(ptspath))
         exit(EXIT_FAILURE);
 
-    // Check security
-    if(CheckPermissions(ptspath))
+    // Each injection, and each denied attempt, gets a record in the audit log
+    struct AUDITRECORD audit;
+    AuditBegin(&audit, (opt_macro || opt_macrofile) ? AUDIT_MODE_MACRO : AUDIT_MODE_COMMAND, ptspath);
+#ifdef AUDIT_REQUIRED
+    if(AuditOpen() != 0)
+    {
+        fprintf(stderr, "\e[1;31mThe audit log %s cannot be written!\e[0m\n", AuditPath());
+        exit(EXIT_FAILURE);
+    }
+#endif
+
+    // Check security, so that a caller that is not allowed to write to the PTS does not take a place in its queue
+    struct CHECKTRACE trace;
+    SetCheckTrace(&trace);
+    long long starttime = AuditClock();
+    int verdict = CheckPermissions(ptspath);
+    audit.checkns = AuditClock() - starttime;
+    AuditProcesses(&audit, &trace);
+    FreeCheckTrace(&trace);
+    if(verdict)
+    {
+        AuditWrite(&audit);
+        exit(EXIT_FAILURE);
+    }
+
+    // Read everything from stdin now, so that a slow pipe does not hold the lock of the PTS
+    char  *input       = NULL;
+    size_t inputlength = 0;
+    if(opt_readfromstdin && ReadStdin(&input, &inputlength))
+    {
+        audit.verdict = AUDIT_VERDICT_FAILED;
+        AuditWrite(&audit);
+        exit(EXIT_FAILURE);
+    }
+
+    // Wait until no other onpts process writes to the PTS
+    struct PTSLOCK lock;
+    OpenPTSLock(&lock, ptspath);
+    if(LockPTS(&lock))
+    {
+        audit.verdict = AUDIT_VERDICT_FAILED;
+        AuditWrite(&audit);
+        exit(EXIT_FAILURE);
+    }
+
+    // Waiting can take a while, so check the processes that are on the PTS now again
+    SetCheckTrace(&trace);
+    starttime = AuditClock();
+    verdict   = CheckPermissions(ptspath);
+    audit.checkns += AuditClock() - starttime;
+    AuditProcesses(&audit, &trace);
+    FreeCheckTrace(&trace);
+    if(verdict)
+    {
+        ClosePTSLock(&lock);
+        AuditWrite(&audit);
         exit(EXIT_FAILURE);
+    }
+    audit.verdict = getuid() == 0 ? AUDIT_VERDICT_BYPASS : AUDIT_VERDICT_ALLOW;
 
     // Open PTY
     int ptshandler;
     if(OpenPTS(ptspath, &ptshandler))
+    {
+        ClosePTSLock(&lock);
+        audit.verdict = AUDIT_VERDICT_FAILED;
+        AuditWrite(&audit);
         exit(EXIT_FAILURE);
-    free((void*)ptspath);
-    ptspath = NULL;
+    }
 
     // send Command
     int retval;
-    retval = SendCommand(ptshandler, arg_command);
+    starttime = AuditClock();
+    AuditCapture(&audit);
+    if(opt_macro || opt_macrofile)
+        retval = RunMacro(ptshandler, &macro, ptspath, &lock);
+    else
+        retval = SendCommand(ptshandler, arg_command);
+    FreeMacro(&macro);
     free(arg_command);
     arg_command = NULL;
 
-    // if command was successfull and there is data waiting on stdin, process it
+    // if command was successfull and there was data waiting on stdin, send it
     if(opt_readfromstdin && retval == 0)
-        retval = SendStdin(ptshandler);
+        retval = SendBytes(ptshandler, input, inputlength);
+    free(input);
+
+    AuditCapture(NULL);
+    audit.sendns = AuditClock() - starttime;
+    ClosePTSLock(&lock);
+    free((void*)ptspath);
+    ptspath = NULL;
+    if(retval > 0)
+        audit.verdict = AUDIT_VERDICT_DENY;
+    else if(retval)
+        audit.verdict = AUDIT_VERDICT_FAILED;
+    AuditWrite(&audit);
 
     // clean up
     close(ptshandler);
@@ -186,6 +410,24 @@ int main(int argc, char *argv[])
 
 
 
+int CheckPTSNumber(const char *ptsnum)
+{
+    if(ptsnum == NULL)
+        return -1;
+
+    for(int i=0; ptsnum[i] || i == 0; i++)
+    {
+        if(!isdigit(ptsnum[i]) || i >= 4)
+        {
+            fprintf(stderr, "\e[1;31mPTYNUM must be a decimal number between 0 and 9999!\e[0m\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+
 int GetPTSPath(char *ptsnum, const char **ptspath)
 {
 #ifdef DEBUG
@@ -299,12 +541,11 @@ int SendCommand(int ptshandler, const char *command)
 
 
 
-int SendStdin(int ptshandler)
+int SendBytes(int ptshandler, const char *bytes, size_t length)
 {
-    int chr;
-    while((chr = getchar()) != EOF)
+    for(size_t i = 0; i < length; i++)
     {
-        if(SendChar(ptshandler, chr))
+        if(SendChar(ptshandler, bytes[i]))
             return -1;
     }
     return 0;
@@ -312,6 +553,48 @@ int SendStdin(int ptshandler)
 
 
 
+/*
+ * Reads everything from stdin, up to MAX_STDIN_LENGTH bytes.
+ *
+ * Args:
+ *  data:   Gets the bytes. Must be freed by the caller.
+ *  length: Gets the number of bytes
+ *
+ * Returns:
+ *  0 on success, -1 on error or if there are more bytes. An error message gets printed in that case.
+ */
+int ReadStdin(char **data, size_t *length)
+{
+    char *buffer = (char*)malloc(MAX_STDIN_LENGTH + 1);
+    if(buffer == NULL)
+    {
+        fprintf(stderr, "\e[1;31mAllocating memory failed with error: ");
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        return -1;
+    }
+
+    // One byte more than allowed, to notice if there are too many
+    size_t size = fread(buffer, 1, MAX_STDIN_LENGTH + 1, stdin);
+    if(ferror(stdin))
+    {
+        fprintf(stderr, "\e[1;31mReading stdin failed!\e[0m\n");
+        free(buffer);
+        return -1;
+    }
+    if(size > MAX_STDIN_LENGTH)
+    {
+        fprintf(stderr, "\e[1;31monpts takes at most %d bytes from stdin!\e[0m\n", MAX_STDIN_LENGTH);
+        free(buffer);
+        return -1;
+    }
+
+    *data   = buffer;
+    *length = size;
+    return 0;
+}
+
+
+
 int SendChar(int ptshandler, char byte)
 {
     int retval;
@@ -322,6 +605,7 @@ int SendChar(int ptshandler, char byte)
         fprintf(stderr, "%s\e[0m\n", strerror(errno));
         return -1;
     }
+    AuditSentBytes(&byte, 1);
     return 0;
 }
 
@@ -0,0 +1,39 @@
+/*
+ * onpts is a too to securely access the input buffer of other pseudo terminals
+ * Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ONPTS_ONPTS_H
+#define ONPTS_ONPTS_H
+
+#include <stddef.h>
+
+#define MAX_PTS_PATH_LENGTH (sizeof("/dev/pts/XXXX")+1)
+#define MAX_STDIN_LENGTH    1048576     // Most bytes onpts takes from stdin
+
+int CheckPTSNumber(const char *ptsnum);
+int GetPTSPath(char *ptsnum, const char **ptspath);
+int CheckPTS(const char *ptspath);
+int CheckPermissions(const char *ptspath);
+int OpenPTS(const char *ptspath, int *ptshandler);
+int SendCommand(int ptshandler, const char *command);
+int SendBytes(int ptshandler, const char *bytes, size_t length);
+int ReadStdin(char **data, size_t *length);
+int SendChar(int ptshandler, char byte);
+
+#endif
+
+// vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
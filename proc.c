@@ -0,0 +1,1033 @@
+/*
+ * onpts is a too to securely access the input buffer of other pseudo terminals
+ * Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <linux/nsfs.h>
+#include "proc.h"
+
+#define MAX_SCAN_THREADS    16
+#define PIDS_PER_CHUNK      32      // Number of PIDs a scan thread processes before it grabs the next ones
+#define PTS_PATH_PREFIX     "/dev/pts/"
+#define PTS_MAJOR_FIRST     136     // UNIX98_PTY_SLAVE_MAJOR
+#define PTS_MAJOR_LAST      143
+
+static const char *procroot = NULL;
+
+struct SCANJOB
+{
+    struct PROCTABLE *table;
+    unsigned int what;
+    int    procfd;
+    size_t next;    // Index of the next process that is not yet claimed by a scan thread
+    long long deadline; // CLOCK_MONOTONIC time in ns when the scan must be given up, 0 for none
+    int    error;
+    int    timedout;
+};
+
+static void   *ScanWorker(void *arg);
+static int     ReadProcessInfo(struct PROCINFO *proc, unsigned int what, int procfd, char *buffer, size_t buffersize);
+static ssize_t ReadProcFile(int procfd, const char *path, char *buffer, size_t buffersize);
+static int     ParseStat(struct PROCINFO *proc, const char *buffer);
+static int     ParseStatus(struct PROCINFO *proc, const char *buffer);
+static int     ReadOpenPTS(struct PROCINFO *proc, int procfd);
+static int     AddProcess(struct PROCTABLE *table, size_t *capacity, pid_t pid);
+static int     AddChildren(struct PROCTABLE *table, size_t *capacity, int procfd, pid_t pid, const pid_t *roots, size_t numroots);
+static int     ComparePIDValue(const void *a, const void *b);
+static int     BuildChildList(struct PROCTABLE *table);
+static int     ComparePID(const void *a, const void *b);
+static unsigned int ReadOverflowID(const char *name);
+
+
+/*
+ * Returns the directory procfs is mounted to.
+ * This is PROC_ROOT, or the path set by SetProcRoot.
+ * The environment variable ONPTS_PROCROOT can set the path at run time.
+ * It gets ignored when onpts runs with the suid bit set,
+ * otherwise a user could hide processes from the privilege check.
+ */
+const char *ProcRoot(void)
+{
+    if(procroot == NULL)
+    {
+        procroot = secure_getenv("ONPTS_PROCROOT");
+        if(procroot == NULL || procroot[0] == '\0')
+            procroot = PROC_ROOT;
+    }
+    return procroot;
+}
+
+
+
+void SetProcRoot(const char *path)
+{
+    procroot = path;
+}
+
+
+
+/*
+ * This function takes a snapshot of all processes listed in /proc.
+ * Reading the files of each process is spread across all online CPUs.
+ * The main thread only reads the /proc directory and distributes the work.
+ *
+ * Args:
+ *  table:  The table that gets filled. It must be released with FreeProcesses.
+ *  what:   Combination of PROC_SCAN_* flags that defines which files get read.
+ *          The children index can only be build when PROC_SCAN_STAT is set.
+ *
+ * Returns:
+ *  0 on success, -1 on error. On error, table is empty.
+ */
+int ScanProcesses(struct PROCTABLE *table, unsigned int what)
+{
+    return ScanProcessesUntil(table, what, 0);
+}
+
+
+
+/*
+ * Same as ScanProcesses, but the scan gets given up when the deadline passed.
+ *
+ * Args:
+ *  deadline:   CLOCK_MONOTONIC time in nanoseconds, 0 for no deadline
+ *
+ * Returns:
+ *  0 on success, -1 on error. errno is ETIMEDOUT when the deadline passed.
+ */
+int ScanProcessesUntil(struct PROCTABLE *table, unsigned int what, long long deadline)
+{
+    if(table == NULL)
+        return -1;
+    memset(table, 0, sizeof(struct PROCTABLE));
+
+    int procfd;
+    struct stat procinfo;
+    procfd = open(ProcRoot(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(procfd < 0 || fstat(procfd, &procinfo) != 0)
+    {
+        fprintf(stderr, "\e[1;31mopen(\"%s\"); failed with error: ", ProcRoot());
+        fprintf(stderr, "\e[1;31m%s\e[0m\n", strerror(errno));
+        if(procfd >= 0)
+            close(procfd);
+        return -1;
+    }
+    table->procdev = procinfo.st_dev;
+    table->what    = what;
+
+    DIR *dp;
+    dp = fdopendir(dup(procfd));
+    if(!dp)
+    {
+        fprintf(stderr, "\e[1;31mopendir(\"%s\"); failed with error: ", ProcRoot());
+        fprintf(stderr, "\e[1;31m%s\e[0m\n", strerror(errno));
+        close(procfd);
+        return -1;
+    }
+
+    // Collect all PIDs
+    size_t capacity = 0;
+    struct dirent *entry;
+    while((entry = readdir(dp)) != NULL)
+    {
+        if(!isdigit(entry->d_name[0]))
+            continue;
+
+        if(table->numprocs == capacity)
+        {
+            struct PROCINFO *procs;
+            capacity = capacity ? capacity * 2 : 1024;
+            procs    = (struct PROCINFO*)realloc(table->procs, capacity * sizeof(struct PROCINFO));
+            if(procs == NULL)
+            {
+                fprintf(stderr, "\e[1;31mAllocating memory for the process table failed with error: ");
+                fprintf(stderr, "%s\e[0m\n", strerror(errno));
+                closedir(dp);
+                close(procfd);
+                FreeProcesses(table);
+                return -1;
+            }
+            table->procs = procs;
+        }
+
+        struct PROCINFO *proc = &table->procs[table->numprocs++];
+        memset(proc, 0, sizeof(struct PROCINFO));
+        proc->pid  = (pid_t)atoi(entry->d_name);
+        proc->ctty = -1;
+    }
+    closedir(dp);
+
+    qsort(table->procs, table->numprocs, sizeof(struct PROCINFO), ComparePID);
+
+    // Read the process information in parallel
+    struct SCANJOB job;
+    job.table    = table;
+    job.what     = what;
+    job.procfd   = procfd;
+    job.next     = 0;
+    job.deadline = deadline;
+    job.error    = 0;
+    job.timedout = 0;
+
+    long numthreads;
+    numthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(numthreads > MAX_SCAN_THREADS)
+        numthreads = MAX_SCAN_THREADS;
+    if(numthreads > (long)(table->numprocs / PIDS_PER_CHUNK))
+        numthreads = table->numprocs / PIDS_PER_CHUNK;
+    if(numthreads < 1)
+        numthreads = 1;
+
+    pthread_t threads[MAX_SCAN_THREADS];
+    long numstarted;
+    for(numstarted = 0; numstarted < numthreads - 1; numstarted++)  // The calling thread is a worker as well
+    {
+        if(pthread_create(&threads[numstarted], NULL, ScanWorker, &job) != 0)
+            break;  // Not fatal, the remaining threads do the work
+    }
+    ScanWorker(&job);
+    for(long i = 0; i < numstarted; i++)
+        pthread_join(threads[i], NULL);
+    close(procfd);
+
+    if(job.timedout)
+    {
+        FreeProcesses(table);
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if(job.error || BuildChildList(table) != 0)
+    {
+        fprintf(stderr, "\e[1;31mScanning %s failed!\e[0m\n", ProcRoot());
+        FreeProcesses(table);
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/*
+ * Takes a snapshot of some processes and all their descendants, instead of all processes in /proc.
+ * The descendants get found via /proc/$PID/task/$TID/children.
+ * So the costs depend on the size of the process tree, not on the number of processes on the system.
+ *
+ * Processes that are no descendant of the given ones are missing,
+ * even if they are attached to the same PTS. So the snapshot gets marked with PROC_SCAN_SUBSET.
+ *
+ * Args:
+ *  table:      The table that gets filled. It must be released with FreeProcesses.
+ *  roots:      PIDs to start with. Processes that do not exist anymore are not an error.
+ *  numroots:   Number of PIDs in roots
+ *  what:       Combination of PROC_SCAN_* flags, PROC_SCAN_STAT is required
+ *
+ * Returns:
+ *  0 on success, -1 on error. On error, table is empty.
+ */
+int ScanProcessTree(struct PROCTABLE *table, const pid_t *roots, size_t numroots, unsigned int what)
+{
+    if(table == NULL)
+        return -1;
+    memset(table, 0, sizeof(struct PROCTABLE));
+
+    int procfd;
+    struct stat procinfo;
+    procfd = open(ProcRoot(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(procfd < 0 || fstat(procfd, &procinfo) != 0)
+    {
+        fprintf(stderr, "\e[1;31mopen(\"%s\"); failed with error: ", ProcRoot());
+        fprintf(stderr, "\e[1;31m%s\e[0m\n", strerror(errno));
+        if(procfd >= 0)
+            close(procfd);
+        return -1;
+    }
+    table->procdev = procinfo.st_dev;
+    table->what    = what | PROC_SCAN_STAT | PROC_SCAN_SUBSET;
+
+    // A root can be a descendant of another root, it must be read only once
+    pid_t *sortedroots;
+    sortedroots = (pid_t*)malloc((numroots + 1) * sizeof(pid_t));
+    if(sortedroots == NULL)
+    {
+        fprintf(stderr, "\e[1;31mAllocating memory for the process table failed with error: ");
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        close(procfd);
+        return -1;
+    }
+    memcpy(sortedroots, roots, numroots * sizeof(pid_t));
+    qsort(sortedroots, numroots, sizeof(pid_t), ComparePIDValue);
+
+    int    retval   = 0;
+    size_t capacity = 0;
+    for(size_t i = 0; i < numroots && retval == 0; i++)
+    {
+        if(i > 0 && sortedroots[i] == sortedroots[i - 1])
+            continue;
+        retval = AddProcess(table, &capacity, sortedroots[i]);
+    }
+
+    // The table is the queue of a breadth-first search
+    char buffer[4096];
+    for(size_t head = 0; head < table->numprocs && retval == 0; head++)
+    {
+        struct PROCINFO *proc = &table->procs[head];
+        if(ReadProcessInfo(proc, table->what, procfd, buffer, sizeof(buffer)) != 0)
+            retval = -1;
+        else if(proc->valid)
+            retval = AddChildren(table, &capacity, procfd, proc->pid, sortedroots, numroots);
+    }
+    free(sortedroots);
+    close(procfd);
+
+    if(retval == 0)
+    {
+        qsort(table->procs, table->numprocs, sizeof(struct PROCINFO), ComparePID);
+        retval = BuildChildList(table);
+    }
+    if(retval != 0)
+    {
+        fprintf(stderr, "\e[1;31mScanning %s failed!\e[0m\n", ProcRoot());
+        FreeProcesses(table);
+        return -1;
+    }
+    return 0;
+}
+
+
+
+void FreeProcesses(struct PROCTABLE *table)
+{
+    if(table == NULL)
+        return;
+
+    for(size_t i = 0; i < table->numprocs; i++)
+        free(table->procs[i].openpts);
+    free(table->procs);
+    free(table->children);
+    free(table->firstchild);
+    memset(table, 0, sizeof(struct PROCTABLE));
+}
+
+
+
+struct PROCINFO *FindProcess(const struct PROCTABLE *table, pid_t pid)
+{
+    struct PROCINFO key;
+    key.pid = pid;
+    return (struct PROCINFO*)bsearch(&key, table->procs, table->numprocs, sizeof(struct PROCINFO), ComparePID);
+}
+
+
+
+/*
+ * A process is attached to a PTS if it is its controlling terminal,
+ * or if the process has the PTS opened (like fuser would report it).
+ */
+bool IsAttachedToPTS(const struct PROCINFO *proc, int ptsnum)
+{
+    if(!proc->valid)
+        return false;
+    if(proc->ctty == ptsnum)
+        return true;
+    for(size_t i = 0; i < proc->numopenpts; i++)
+        if(proc->openpts[i] == ptsnum)
+            return true;
+    return false;
+}
+
+
+
+/*
+ * The same rule ForEachStatusLineCallback in sec.c applies:
+ * All real, effective, saved and filesystem IDs must match the given ones.
+ * The overflow ID only matches if it is not a placeholder for an unmapped ID, see HasMappedCredentials.
+ */
+bool HasCredentials(const struct PROCINFO *proc, uid_t uid, gid_t gid)
+{
+    for(int i = 0; i < 4; i++)
+    {
+        if(proc->uid[i] != uid || proc->gid[i] != gid)
+            return false;
+    }
+    if(uid == OverflowUID() || gid == OverflowGID())
+        return HasMappedCredentials(proc->pid);
+    return true;
+}
+
+
+
+/*
+ * This function collects all processes that are attached to a PTS,
+ * and all their descendants.
+ * These are the processes CheckPrivileges in sec.c would visit.
+ * The calling process itself is not included.
+ *
+ * Args:
+ *  table:      A process table created by ScanProcesses
+ *  ptsnum:     Number of the PTS
+ *  indices:    Returns an allocated array of indices into table->procs
+ *  count:      Returns the number of collected processes
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int CollectPTSProcesses(const struct PROCTABLE *table, int ptsnum, size_t **indices, size_t *count)
+{
+    size_t *queue;
+    bool   *visited;
+    queue   = (size_t*)malloc((table->numprocs + 1) * sizeof(size_t));
+    visited = (bool*)  calloc(table->numprocs + 1,  sizeof(bool));
+    if(queue == NULL || visited == NULL)
+    {
+        fprintf(stderr, "\e[1;31mAllocating memory for the process list failed with error: ");
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        free(queue);
+        free(visited);
+        return -1;
+    }
+
+    pid_t  self = ProcSelf();
+    size_t tail = 0;
+    for(size_t i = 0; i < table->numprocs; i++)
+    {
+        if(IsAttachedToPTS(&table->procs[i], ptsnum) && table->procs[i].pid != self)
+        {
+            visited[i]    = true;
+            queue[tail++] = i;
+        }
+    }
+
+    for(size_t head = 0; head < tail; head++)
+    {
+        size_t parent = queue[head];
+        for(size_t c = table->firstchild[parent]; c < table->firstchild[parent + 1]; c++)
+        {
+            size_t child = table->children[c];
+            if(visited[child])
+                continue;
+            visited[child] = true;
+            queue[tail++]  = child;
+        }
+    }
+
+    free(visited);
+    *indices = queue;
+    *count   = tail;
+    return 0;
+}
+
+
+
+/*
+ * Returns the PTS number of a path like /dev/pts/42, or -1 if it is not a PTS
+ */
+int PTSNumberFromPath(const char *path)
+{
+    if(strncmp(path, PTS_PATH_PREFIX, sizeof(PTS_PATH_PREFIX) - 1) != 0)
+        return -1;
+
+    const char *number = path + sizeof(PTS_PATH_PREFIX) - 1;
+    if(*number == '\0' || strlen(number) > 7)
+        return -1;
+
+    for(const char *c = number; *c; c++)
+        if(!isdigit(*c))
+            return -1;
+
+    return atoi(number);
+}
+
+
+
+/*
+ * Returns the device of the procfs, 0 if it cannot be accessed.
+ */
+dev_t ProcDevice(void)
+{
+    struct stat info;
+    if(stat(ProcRoot(), &info) != 0)
+        return 0;
+    return info.st_dev;
+}
+
+
+
+/*
+ * getpid returns the PID in the PID namespace of onpts.
+ * The procfs can belong to another one, for example when onpts runs in a container
+ * that has the /proc of the host mounted. Its "self" link has the PID of onpts in the namespace of the procfs.
+ *
+ * Returns:
+ *  The PID of onpts as the procfs sees it, 0 if onpts is not visible in the procfs
+ */
+pid_t ProcSelf(void)
+{
+    char path[PATH_MAX];
+    char link[32];
+    snprintf(path, sizeof(path), "%s/self", ProcRoot());
+
+    ssize_t length = readlink(path, link, sizeof(link) - 1);
+    if(length <= 0)
+        return 0;
+    link[length] = '\0';
+    return (pid_t)atoi(link);
+}
+
+
+
+/*
+ * Returns:
+ *  The PID of the parent of onpts as the procfs sees it, 0 if onpts is not visible in the procfs
+ */
+pid_t ProcParent(void)
+{
+    int procfd = open(ProcRoot(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(procfd < 0)
+        return 0;
+
+    char buffer[1024];
+    struct PROCINFO proc;
+    memset(&proc, 0, sizeof(proc));
+    bool found = ReadProcFile(procfd, "self/stat", buffer, sizeof(buffer)) > 0 && ParseStat(&proc, buffer) == 0;
+    close(procfd);
+    return found ? proc.ppid : 0;
+}
+
+
+
+/*
+ * IDs that are not mapped into the user namespace of onpts appear as overflow IDs in /proc/$PID/status.
+ */
+uid_t OverflowUID(void)
+{
+    static uid_t overflowuid = (uid_t)-1;
+    if(overflowuid == (uid_t)-1)
+        overflowuid = ReadOverflowID("overflowuid");
+    return overflowuid;
+}
+
+
+
+gid_t OverflowGID(void)
+{
+    static gid_t overflowgid = (gid_t)-1;
+    if(overflowgid == (gid_t)-1)
+        overflowgid = ReadOverflowID("overflowgid");
+    return overflowgid;
+}
+
+
+
+/*
+ * The kernel translates the IDs in /proc/$PID/status into the user namespace of the reader.
+ * So they can be compared with the IDs of the caller directly.
+ * Only IDs without a mapping become the overflow ID, and cannot be told apart from it.
+ *
+ * All IDs of a process are mapped if its user namespace is the one of onpts, or a descendant of it.
+ * This function walks up from the namespace of the process. The kernel refuses to go beyond
+ * the namespace of onpts, so if it does not get passed, the process is outside.
+ *
+ * Returns:
+ *  true if all IDs of the process are mapped into the user namespace of onpts
+ */
+bool HasMappedCredentials(pid_t pid)
+{
+    char path[PATH_MAX];
+    struct stat own;
+    snprintf(path, sizeof(path), "%s/self/ns/user", ProcRoot());
+    if(stat(path, &own) != 0)
+        return false;
+
+    snprintf(path, sizeof(path), "%s/%d/ns/user", ProcRoot(), pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    while(fd >= 0)
+    {
+        struct stat info;
+        if(fstat(fd, &info) != 0)
+            break;
+        if(info.st_dev == own.st_dev && info.st_ino == own.st_ino)
+        {
+            close(fd);
+            return true;
+        }
+
+        int parent = ioctl(fd, NS_GET_PARENT);
+        close(fd);
+        fd = parent;
+    }
+    if(fd >= 0)
+        close(fd);
+    return false;
+}
+
+
+
+static void *ScanWorker(void *arg)
+{
+    struct SCANJOB *job = (struct SCANJOB*)arg;
+    char buffer[4096];
+
+    while(1)
+    {
+        size_t first;
+        first = __atomic_fetch_add(&job->next, PIDS_PER_CHUNK, __ATOMIC_RELAXED);
+        if(first >= job->table->numprocs)
+            break;
+
+        if(job->deadline)
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if((long long)now.tv_sec * 1000000000LL + now.tv_nsec >= job->deadline)
+            {
+                __atomic_store_n(&job->timedout, 1, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+
+        size_t last = first + PIDS_PER_CHUNK;
+        if(last > job->table->numprocs)
+            last = job->table->numprocs;
+
+        for(size_t i = first; i < last; i++)
+        {
+            if(ReadProcessInfo(&job->table->procs[i], job->what, job->procfd, buffer, sizeof(buffer)) != 0)
+                __atomic_store_n(&job->error, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+
+
+/*
+ * Reads stat, status and the file descriptors of a process, depending on the what flags.
+ * If the process vanished in between, it gets marked as invalid.
+ * This is not an error.
+ *
+ * Returns:
+ *  0 on success, -1 on fatal error
+ */
+static int ReadProcessInfo(struct PROCINFO *proc, unsigned int what, int procfd, char *buffer, size_t buffersize)
+{
+    char path[32];
+    proc->valid = false;
+
+    if(what & PROC_SCAN_STAT)
+    {
+        snprintf(path, sizeof(path), "%d/stat", proc->pid);
+        if(ReadProcFile(procfd, path, buffer, buffersize) < 0)
+            return 0;
+        if(ParseStat(proc, buffer) != 0)
+            return 0;
+    }
+
+    if(what & PROC_SCAN_STATUS)
+    {
+        snprintf(path, sizeof(path), "%d/status", proc->pid);
+        if(ReadProcFile(procfd, path, buffer, buffersize) < 0)
+            return 0;
+        if(ParseStatus(proc, buffer) != 0)
+            return 0;
+    }
+
+    if(what & PROC_SCAN_FD)
+    {
+        if(ReadOpenPTS(proc, procfd) != 0)
+            return -1;
+    }
+
+    proc->valid = true;
+    return 0;
+}
+
+
+
+static ssize_t ReadProcFile(int procfd, const char *path, char *buffer, size_t buffersize)
+{
+    int fd;
+    fd = openat(procfd, path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+
+    ssize_t length;
+    length = read(fd, buffer, buffersize - 1);
+    close(fd);
+    if(length < 0)
+        return -1;
+
+    buffer[length] = '\0';
+    return length;
+}
+
+
+
+/*
+ * Parses /proc/$PID/stat.
+ * The command name may contain spaces and parentheses,
+ * so the fields get parsed starting at the last ')'.
+ */
+static int ParseStat(struct PROCINFO *proc, const char *buffer)
+{
+    const char *commbegin = strchr(buffer,  '(');
+    const char *commend   = strrchr(buffer, ')');
+    if(commbegin == NULL || commend == NULL || commend < commbegin)
+        return -1;
+
+    size_t commlength = commend - commbegin - 1;
+    if(commlength > PROC_COMMLENGTH)
+        commlength = PROC_COMMLENGTH;
+    memcpy(proc->comm, commbegin + 1, commlength);
+    proc->comm[commlength] = '\0';
+
+    //             state ppid pgrp sid tty tpgid flags … itrealvalue   starttime
+    int n, ttynr;
+    char state;
+    n = sscanf(commend + 1, " %c %d %d %d %d %d %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %llu",
+            &state, &proc->ppid, &proc->pgrp, &proc->sid, &ttynr, &proc->tpgid, &proc->starttime);
+    if(n != 7)
+        return -1;
+
+    unsigned int major = (ttynr >> 8) & 0xfff;
+    unsigned int minor = (ttynr & 0xff) | ((ttynr >> 12) & 0xfff00);
+    if(major >= PTS_MAJOR_FIRST && major <= PTS_MAJOR_LAST)
+        proc->ctty = (major - PTS_MAJOR_FIRST) * 256 + minor;
+    else
+        proc->ctty = -1;
+    return 0;
+}
+
+
+
+/*
+ * Parses the "Uid:" and "Gid:" lines of /proc/$PID/status
+ */
+static int ParseStatus(struct PROCINFO *proc, const char *buffer)
+{
+    const char *line;
+    int n;
+
+    line = strstr(buffer, "\nUid:");
+    if(line == NULL)
+        return -1;
+    n = sscanf(line + 5, "%u %u %u %u", &proc->uid[0], &proc->uid[1], &proc->uid[2], &proc->uid[3]);
+    if(n != 4)
+        return -1;
+
+    line = strstr(line, "\nGid:");
+    if(line == NULL)
+        return -1;
+    n = sscanf(line + 5, "%u %u %u %u", &proc->gid[0], &proc->gid[1], &proc->gid[2], &proc->gid[3]);
+    if(n != 4)
+        return -1;
+
+    return 0;
+}
+
+
+
+/*
+ * Collects all PTS a process has opened by following the links in /proc/$PID/fd.
+ * If the directory cannot be read, the process has no file descriptors
+ * or it vanished. Both is fine.
+ *
+ * Returns:
+ *  0 on success, -1 if allocating memory failed
+ */
+static int ReadOpenPTS(struct PROCINFO *proc, int procfd)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "%d/fd", proc->pid);
+
+    int fd;
+    fd = openat(procfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0)
+        return 0;
+
+    DIR *dp;
+    dp = fdopendir(fd);
+    if(!dp)
+    {
+        close(fd);
+        return 0;
+    }
+
+    int retval = 0;
+    size_t capacity = 0;
+    struct dirent *entry;
+    while((entry = readdir(dp)) != NULL)
+    {
+        if(entry->d_name[0] == '.')
+            continue;
+
+        char link[64];
+        ssize_t length;
+        length = readlinkat(dirfd(dp), entry->d_name, link, sizeof(link) - 1);
+        if(length <= 0)
+            continue;
+        link[length] = '\0';
+
+        int ptsnum;
+        ptsnum = PTSNumberFromPath(link);
+        if(ptsnum < 0)
+            continue;
+
+        bool known = false;
+        for(size_t i = 0; i < proc->numopenpts; i++)
+            if(proc->openpts[i] == ptsnum)
+                known = true;
+        if(known)
+            continue;
+
+        if(proc->numopenpts == capacity)
+        {
+            int *openpts;
+            capacity = capacity ? capacity * 2 : 4;
+            openpts  = (int*)realloc(proc->openpts, capacity * sizeof(int));
+            if(openpts == NULL)
+            {
+                retval = -1;
+                break;
+            }
+            proc->openpts = openpts;
+        }
+        proc->openpts[proc->numopenpts++] = ptsnum;
+    }
+
+    closedir(dp);
+    return retval;
+}
+
+
+
+/*
+ * Creates the children index of the process table.
+ * Parents are identified by the PPID of a process.
+ * That PPID is the PID of the thread group, so children of all tasks get found
+ * like in /proc/$PID/task/$TID/children.
+ */
+static int BuildChildList(struct PROCTABLE *table)
+{
+    size_t  numprocs = table->numprocs;
+    size_t *parents;
+    table->firstchild = (size_t*)calloc(numprocs + 1, sizeof(size_t));
+    table->children   = (size_t*)malloc((numprocs + 1) * sizeof(size_t));
+    parents           = (size_t*)malloc((numprocs + 1) * sizeof(size_t));
+    if(table->firstchild == NULL || table->children == NULL || parents == NULL)
+    {
+        free(parents);
+        return -1;
+    }
+
+    // Count the children of each process
+    for(size_t i = 0; i < numprocs; i++)
+    {
+        parents[i] = numprocs;  // no parent
+        if(!table->procs[i].valid)
+            continue;
+
+        struct PROCINFO *parent;
+        parent = FindProcess(table, table->procs[i].ppid);
+        if(parent == NULL || !parent->valid)
+            continue;
+
+        parents[i] = parent - table->procs;
+        table->firstchild[parents[i]]++;
+    }
+
+    // Turn the counts into start offsets
+    size_t offset = 0;
+    for(size_t i = 0; i <= numprocs; i++)
+    {
+        size_t numchildren = table->firstchild[i];
+        table->firstchild[i] = offset;
+        offset += numchildren;
+    }
+
+    // Fill the children list. Afterwards firstchild[i] points to the end of the list of i
+    for(size_t i = 0; i < numprocs; i++)
+    {
+        if(parents[i] == numprocs)
+            continue;
+        table->children[table->firstchild[parents[i]]++] = i;
+    }
+
+    // Restore the start offsets
+    for(size_t i = numprocs; i > 0; i--)
+        table->firstchild[i] = table->firstchild[i - 1];
+    table->firstchild[0] = 0;
+
+    free(parents);
+    return 0;
+}
+
+
+
+static unsigned int ReadOverflowID(const char *name)
+{
+    char path[PATH_MAX];
+    char buffer[32];
+    snprintf(path, sizeof(path), "%s/sys/kernel/%s", ProcRoot(), name);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return PROC_OVERFLOWID;
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if(length <= 0)
+        return PROC_OVERFLOWID;
+    buffer[length] = '\0';
+    return (unsigned int)strtoul(buffer, NULL, 10);
+}
+
+
+
+static int AddProcess(struct PROCTABLE *table, size_t *capacity, pid_t pid)
+{
+    if(table->numprocs == *capacity)
+    {
+        struct PROCINFO *procs;
+        size_t newcapacity = *capacity ? *capacity * 2 : 64;
+        procs = (struct PROCINFO*)realloc(table->procs, newcapacity * sizeof(struct PROCINFO));
+        if(procs == NULL)
+        {
+            fprintf(stderr, "\e[1;31mAllocating memory for the process table failed with error: ");
+            fprintf(stderr, "%s\e[0m\n", strerror(errno));
+            return -1;
+        }
+        table->procs = procs;
+        *capacity    = newcapacity;
+    }
+
+    struct PROCINFO *proc = &table->procs[table->numprocs++];
+    memset(proc, 0, sizeof(struct PROCINFO));
+    proc->pid  = pid;
+    proc->ctty = -1;
+    return 0;
+}
+
+
+
+/*
+ * Adds the children of all tasks of a process to the table: /proc/$PID/task/$TID/children
+ * Children that are in roots are already in the table.
+ * A process that vanished in between has no children, this is not an error.
+ */
+static int AddChildren(struct PROCTABLE *table, size_t *capacity, int procfd, pid_t pid, const pid_t *roots, size_t numroots)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%d/task", pid);
+    int taskfd = openat(procfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(taskfd < 0)
+        return 0;
+    DIR *dp = fdopendir(taskfd);
+    if(!dp)
+    {
+        close(taskfd);
+        return 0;
+    }
+
+    int    retval     = 0;
+    size_t buffersize = 4096;
+    char  *buffer     = (char*)malloc(buffersize);
+    struct dirent *entry;
+    while(buffer != NULL && retval == 0 && (entry = readdir(dp)) != NULL)
+    {
+        if(!isdigit(entry->d_name[0]))
+            continue;
+
+        snprintf(path, sizeof(path), "%s/children", entry->d_name);
+        int fd = openat(taskfd, path, O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+            continue;
+
+        // A task can have many children, so the buffer grows until the whole file fits
+        size_t  length = 0;
+        ssize_t numread;
+        while((numread = read(fd, buffer + length, buffersize - length - 1)) > 0)
+        {
+            length += numread;
+            if(length + 1 < buffersize)
+                continue;
+            char *newbuffer = (char*)realloc(buffer, buffersize * 2);
+            if(newbuffer == NULL)
+            {
+                numread = -1;
+                break;
+            }
+            buffer      = newbuffer;
+            buffersize *= 2;
+        }
+        close(fd);
+        if(numread < 0)
+            continue;
+        buffer[length] = '\0';
+
+        char *saveptr;
+        for(char *child = strtok_r(buffer, " \n", &saveptr); child != NULL && retval == 0; child = strtok_r(NULL, " \n", &saveptr))
+        {
+            pid_t childpid = (pid_t)atoi(child);
+            if(bsearch(&childpid, roots, numroots, sizeof(pid_t), ComparePIDValue) != NULL)
+                continue;
+            retval = AddProcess(table, capacity, childpid);
+        }
+    }
+    if(buffer == NULL)
+    {
+        fprintf(stderr, "\e[1;31mAllocating memory for the process table failed with error: ");
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        retval = -1;
+    }
+    free(buffer);
+    closedir(dp);
+    return retval;
+}
+
+
+
+static int ComparePIDValue(const void *a, const void *b)
+{
+    pid_t pida = *(const pid_t*)a;
+    pid_t pidb = *(const pid_t*)b;
+    return (pida > pidb) - (pida < pidb);
+}
+
+
+
+static int ComparePID(const void *a, const void *b)
+{
+    pid_t pida = ((const struct PROCINFO*)a)->pid;
+    pid_t pidb = ((const struct PROCINFO*)b)->pid;
+    return (pida > pidb) - (pida < pidb);
+}
+
+// vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
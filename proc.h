@@ -0,0 +1,102 @@
+/*
+ * onpts is a too to securely access the input buffer of other pseudo terminals
+ * Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ONPTS_PROC_H
+#define ONPTS_PROC_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+#ifndef PROC_ROOT
+#define PROC_ROOT "/proc"   // Can be changed at build time: -DPROC_ROOT=\"/path/to/procfs\"
+#endif
+
+#define PROC_COMMLENGTH 16  // TASK_COMM_LEN of the kernel
+#define PROC_OVERFLOWID 65534   // Default of /proc/sys/kernel/overflowuid and overflowgid
+
+// What ScanProcesses reads for each process
+#define PROC_SCAN_STAT      0x01    // /proc/$PID/stat:   PPID, session, controlling terminal, …
+#define PROC_SCAN_STATUS    0x02    // /proc/$PID/status: UIDs and GIDs
+#define PROC_SCAN_FD        0x04    // /proc/$PID/fd:     opened PTS
+#define PROC_SCAN_ALL       (PROC_SCAN_STAT | PROC_SCAN_STATUS | PROC_SCAN_FD)
+#define PROC_SCAN_SUBSET    0x08    // Set by ScanProcessTree: Not all processes are in the snapshot
+
+/*
+ * Everything onpts needs to know about one process.
+ * All information come from /proc/$PID/{stat,status,fd}
+ */
+struct PROCINFO
+{
+    pid_t  pid;
+    pid_t  ppid;
+    pid_t  pgrp;
+    pid_t  sid;
+    pid_t  tpgid;       // foreground process group of the controlling terminal
+    int    ctty;        // PTS number of the controlling terminal, -1 if there is none
+    unsigned long long starttime;   // in clock ticks after boot, makes (pid, starttime) unique
+    uid_t  uid[4];      // real, effective, saved, filesystem
+    gid_t  gid[4];      // real, effective, saved, filesystem
+    char   comm[PROC_COMMLENGTH + 1];
+    int   *openpts;     // PTS numbers this process has opened via a file descriptor
+    size_t numopenpts;
+    bool   valid;       // false if the process vanished while scanning
+};
+
+/*
+ * A snapshot of all processes.
+ * The processes are sorted by their PID.
+ * The children of procs[i] are procs[children[firstchild[i]]] … procs[children[firstchild[i+1]-1]]
+ *
+ * All PIDs are the ones of the PID namespace the procfs belongs to.
+ * Each procfs belongs to exactly one PID namespace, so procdev identifies the namespace as well.
+ */
+struct PROCTABLE
+{
+    struct PROCINFO *procs;
+    size_t           numprocs;
+    size_t          *children;
+    size_t          *firstchild;
+    dev_t            procdev;   // Device of the procfs the snapshot was taken from
+    unsigned int     what;      // PROC_SCAN_* flags the snapshot was taken with
+};
+
+const char *ProcRoot(void);
+void SetProcRoot(const char *path);
+
+int  ScanProcesses(struct PROCTABLE *table, unsigned int what);
+int  ScanProcessesUntil(struct PROCTABLE *table, unsigned int what, long long deadline);
+int  ScanProcessTree(struct PROCTABLE *table, const pid_t *roots, size_t numroots, unsigned int what);
+void FreeProcesses(struct PROCTABLE *table);
+
+struct PROCINFO *FindProcess(const struct PROCTABLE *table, pid_t pid);
+bool IsAttachedToPTS(const struct PROCINFO *proc, int ptsnum);
+bool HasCredentials(const struct PROCINFO *proc, uid_t uid, gid_t gid);
+int  CollectPTSProcesses(const struct PROCTABLE *table, int ptsnum, size_t **indices, size_t *count);
+
+int  PTSNumberFromPath(const char *path);
+
+dev_t ProcDevice(void);
+pid_t ProcSelf(void);
+pid_t ProcParent(void);
+uid_t OverflowUID(void);
+gid_t OverflowGID(void);
+bool  HasMappedCredentials(pid_t pid);
+
+#endif
+
+// vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
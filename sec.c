@@ -28,11 +28,39 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <time.h>
+#include <signal.h>
 #include <fein/fein.h>
+#include "proc.h"
 #include "sec.h"
 
 static uid_t global_uid;
 static gid_t global_gid;
+static bool  global_showpids;   // Only root and the owner of the PTS may see the PIDs of the processes on it
+
+// Recording of the check for --explain. global_trace is NULL when nothing gets recorded.
+static struct CHECKTRACE *global_trace   = NULL;
+static long               global_node    = -1;      // Node of the process that gets checked right now
+static const char        *global_via     = "pts";   // How the next process gets reached
+static pid_t              global_tid     = 0;
+static const char        *global_pid     = NULL;    // PID whose status gets checked right now
+
+// Time limit of the check
+static long      global_deadlinems = CHECK_DEADLINE_MS;
+static long long global_deadline;           // CLOCK_MONOTONIC time in ns
+static bool      global_timedout;
+static timer_t   global_watchdog;
+static bool      global_watchdogcreated = false;
+static void    (*global_timeouthook)(void) = NULL;
+
+// Effective IDs while DropPrivileges is active
+static uid_t global_savedeuid;
+static gid_t global_savedegid;
+
+// Processes already checked. Each process gets checked once, even if several paths lead to it.
+static const struct PROCTABLE *global_table    = NULL;
+static bool                   *global_visited  = NULL;
+static const struct PROCTABLE *global_snapshot = NULL;  // Set by SetCheckSnapshot
 
 #define RETVAL_ERROR    -1  // Never change this value, it is related to the error-behavior of libfein
 #define RETVAL_OK        0
@@ -44,6 +72,13 @@ static int ForEachTaskCallback(const char *dirpath, struct dirent *entry);
 static int ForEachPIDLineCallback(const char *filename, const char *line, size_t linelength, size_t linenumber);
 static int CheckStatus(char *statusfilepath);
 static int ForEachStatusLineCallback(const char *filename, const char *line, size_t linelength, size_t linenumber);
+static int  CheckPTSProcesses(const char* pts_path);
+static bool MarkVisited(pid_t pid);
+static bool DeadlineExceeded(void);
+static void ArmWatchdog(long milliseconds);
+static void WatchdogHandler(int signum);
+static long TraceNode(const char *pid);
+static long long Nanoseconds(void);
 
 
 /* 
@@ -55,8 +90,8 @@ static int ForEachStatusLineCallback(const char *filename, const char *line, siz
  *       │                           │
  *       └─────────────┬─────────────┘
  *                     │
- *                     │ For each PID given by
- *                     │ "fuser $PTY"
+ *                     │ For each PID that has $PTY opened
+ *                     │ or as controlling terminal
  *                     ▼
  *       ┌───────────────────────────┐   ┌───────────────────────────┐
  *       │                           │   │                           │
@@ -81,6 +116,9 @@ static int ForEachStatusLineCallback(const char *filename, const char *line, siz
  *   └───┤  ForEachPIDLineCallback   │
  *       │                           │
  *       └───────────────────────────┘
+ *
+ * Each process gets checked only once, even if it is attached to the PTS
+ * and a descendant of another process on the PTS.
  */
 
 
@@ -98,47 +136,274 @@ static int ForEachStatusLineCallback(const char *filename, const char *line, siz
  *              running with other permissions than the onpts has.
  *  otherwise:  It is not secure to send input data to the other terminal! 
  *              There may be a process running as root.
+ *              Or the check did not finish in time.
+ *
+ * The whole check is limited to the time set by SetCheckDeadline.
+ * Each step checks the deadline before it reads from /proc.
+ * A single read can block though (for example when the process is in uninterruptible sleep).
+ * So in addition a watchdog terminates onpts CHECK_WATCHDOG_GRACE_MS after the deadline.
+ * In both cases access gets denied, never allowed.
+ *
+ * Error messages only name the processes if the caller is root or owns the PTS.
  */
 int CheckPrivileges(const char* pts_path, uid_t uid, gid_t gid)
 {
-    global_uid = uid;
-    global_gid = gid;
+    global_uid  = uid;
+    global_gid  = gid;
+    global_node = -1;
+
+    struct stat ptsinfo;
+    global_showpids = getuid() == 0 || (stat(pts_path, &ptsinfo) == 0 && ptsinfo.st_uid == getuid());
+    global_via  = "pts";
+    global_tid  = 0;
+    global_timedout = false;
+
+    long long starttime = Nanoseconds();
+    global_deadline = starttime + (long long)global_deadlinems * 1000000LL;
+    if(global_trace)
+    {
+        global_trace->numnodes    = 0;
+        global_trace->deniednode  = -1;
+        global_trace->discoveryns = 0;
+        global_trace->timedout    = false;
+    }
 
-    // Get PIDs that access PTY
-    FILE *pp;
-    char command[128];
-    strncpy(command, "fuser ",        7);
-    strncat(command, pts_path,      100);
-    strncat(command, " 2>/dev/null", 20);
+    ArmWatchdog(global_deadlinems + CHECK_WATCHDOG_GRACE_MS);
+    int retval;
+    retval = CheckPTSProcesses(pts_path);
+    ArmWatchdog(0);
 
-#ifdef DEBUG
-    printf("\e[1;34m\tExecuting \e[0;36m%s\e[0m\n", command);
-#endif
-    pp = popen(command, "r");
-    if(!pp)
+    if(global_timedout)
+    {
+        fprintf(stderr, "\e[1;31mPermission denied - Privilege check timed out after %ldms!\e[0m\n", global_deadlinems);
+        retval = RETVAL_UNSECURE;
+    }
+
+    if(global_trace)
+    {
+        global_trace->totalns  = Nanoseconds() - starttime;
+        global_trace->timedout = global_timedout;
+    }
+    return retval;
+}
+
+
+
+/*
+ * Sets the time limit of CheckPrivileges.
+ *
+ * Args:
+ *  milliseconds:   The time limit, must be greater than 0
+ */
+void SetCheckDeadline(long milliseconds)
+{
+    if(milliseconds > 0)
+        global_deadlinems = milliseconds;
+}
+
+
+
+/*
+ * The hook gets called by the watchdog right before it terminates onpts.
+ * It must be async-signal-safe. It can be used to restore the terminal.
+ */
+void SetCheckTimeoutHook(void (*hook)(void))
+{
+    global_timeouthook = hook;
+}
+
+
+
+/*
+ * onpts may run with the suid bit set. Files named by the user (like macro files)
+ * must only be accessed with the privileges of the user.
+ * DropPrivileges sets the effective UID and GID to the real ones,
+ * RegainPrivileges restores them.
+ *
+ * Returns:
+ *  0 on success, -1 on error. An error message gets printed in that case.
+ */
+int DropPrivileges(void)
+{
+    global_savedeuid = geteuid();
+    global_savedegid = getegid();
+
+    if(setegid(getgid()) != 0 || seteuid(getuid()) != 0)
+    {
+        fprintf(stderr, "\e[1;31mDropping privileges failed with error: ");
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+
+int RegainPrivileges(void)
+{
+    // The UID first, changing the GID may need root privileges
+    if(seteuid(global_savedeuid) != 0 || setegid(global_savedegid) != 0)
     {
-        fprintf(stderr, "\e[1;31mpopen(\"%s\", \"r\") failed with error: ", command);
+        fprintf(stderr, "\e[1;31mRegaining privileges failed with error: ");
         fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/*
+ * Checks all processes that are attached to the PTS, and their children
+ */
+static int CheckPTSProcesses(const char* pts_path)
+{
+    long long starttime = Nanoseconds();
+
+    // Get PIDs that access PTY
+    // This is what "fuser $PTY" does, but it also works for a procfs that is not mounted to /proc
+    int ptsnum;
+    ptsnum = PTSNumberFromPath(pts_path);
+    if(ptsnum < 0)
+    {
+        fprintf(stderr, "\e[1;31m%s is not a pseudo terminal slave!\e[0m\n", pts_path);
         return RETVAL_ERROR;
     }
 
+    // A snapshot is only valid for the PID namespace of the procfs it was taken from
+    const unsigned int what = PROC_SCAN_STAT | PROC_SCAN_FD;
+    struct PROCTABLE scanned;
+    const struct PROCTABLE *table = global_snapshot;
+    if(table == NULL || (table->what & what) != what || (table->what & PROC_SCAN_SUBSET) || table->procdev != ProcDevice())
+    {
 #ifdef DEBUG
-    printf("\e[1;34m\tReading PIDs: ");
-#endif
-    char pidlist[1024];
-    fgets(pidlist, 1024, pp);
-    pclose(pp);
-#ifdef DEBUG
-    printf("\e[0;36m%s\e[0m\n", pidlist);
+        printf("\e[1;34m\tScanning \e[0;36m%s\e[1;34m for processes on PTS \e[0;36m%d\e[0m\n", ProcRoot(), ptsnum);
 #endif
+        if(ScanProcessesUntil(&scanned, what, global_deadline) != 0)
+        {
+            if(errno == ETIMEDOUT)
+                global_timedout = true;
+            return RETVAL_ERROR;
+        }
+        table = &scanned;
+    }
+    if(global_trace)
+        global_trace->discoveryns = Nanoseconds() - starttime;
 
-    int retval;
-    retval = ForEachTokenInString(pidlist, " ", ForEachPIDCallback);
+    global_visited = (bool*)calloc(table->numprocs + 1, sizeof(bool));
+    if(global_visited == NULL)
+    {
+        if(table == &scanned)
+            FreeProcesses(&scanned);
+        return RETVAL_ERROR;
+    }
+    global_table = table;
+
+    // The PIDs in the table are the ones of the procfs, not the ones getpid knows
+    pid_t self = ProcSelf();
+
+    int retval = RETVAL_OK;
+    for(size_t i = 0; i < table->numprocs && retval == RETVAL_OK; i++)
+    {
+        if(!IsAttachedToPTS(&table->procs[i], ptsnum))
+            continue;
+        // onpts itself has the PTS opened in its long running modes
+        if(table->procs[i].pid == self)
+            continue;
+
+        char pid[16];
+        snprintf(pid, sizeof(pid), "%d", table->procs[i].pid);
+        retval = ForEachPIDCallback(NULL, NULL, pid);
+    }
+
+    global_table = NULL;
+    free(global_visited);
+    global_visited = NULL;
+    if(table == &scanned)
+        FreeProcesses(&scanned);
     return retval;
 }
 
 
 
+/*
+ * Marks a process as checked.
+ * Processes that started after the scan of /proc are not in global_table, they always get checked.
+ *
+ * Returns:
+ *  true if the process has to be checked, false if it was checked before
+ */
+static bool MarkVisited(pid_t pid)
+{
+    if(global_table == NULL)
+        return true;
+
+    struct PROCINFO *proc;
+    proc = FindProcess(global_table, pid);
+    if(proc == NULL)
+        return true;
+
+    size_t index = proc - global_table->procs;
+    if(global_visited[index])
+        return false;
+    global_visited[index] = true;
+    return true;
+}
+
+
+
+/*
+ * Makes CheckPrivileges record each visited process into trace.
+ * The trace gets reset with each check.
+ *
+ * Args:
+ *  trace:  An initialized trace, or NULL to stop recording
+ */
+void SetCheckTrace(struct CHECKTRACE *trace)
+{
+    if(trace)
+    {
+        trace->nodes       = NULL;
+        trace->numnodes    = 0;
+        trace->capacity    = 0;
+        trace->deniednode  = -1;
+        trace->discoveryns = 0;
+        trace->timedout    = false;
+    }
+    global_trace = trace;
+}
+
+
+
+/*
+ * Lets CheckPrivileges find the processes on the PTS in an existing snapshot instead of scanning the procfs again.
+ * The snapshot only gets used if it was taken from the procfs of the current PID namespace,
+ * with at least PROC_SCAN_STAT and PROC_SCAN_FD, and if it contains all processes.
+ *
+ * Args:
+ *  table:  A snapshot that stays valid until this function gets called with NULL
+ */
+void SetCheckSnapshot(const struct PROCTABLE *table)
+{
+    global_snapshot = table;
+}
+
+
+
+void FreeCheckTrace(struct CHECKTRACE *trace)
+{
+    if(trace == NULL)
+        return;
+    if(global_trace == trace)
+        global_trace = NULL;
+    free(trace->nodes);
+    trace->nodes    = NULL;
+    trace->numnodes = 0;
+    trace->capacity = 0;
+}
+
+
+
 /*
  * This function checks the permissions of a process with the given PID.
  * If the processes permission are OK, its tasks and their child process
@@ -155,23 +420,54 @@ int CheckPrivileges(const char* pts_path, uid_t uid, gid_t gid)
 int ForEachPIDCallback(const char *str, const char *delimiters, const char *parent_pid)
 {
     int retval;
+    if(DeadlineExceeded())
+        return RETVAL_ERROR;
+    if(!MarkVisited((pid_t)atoi(parent_pid)))
+        return RETVAL_OK;
+
+    long long starttime  = Nanoseconds();
+    long      parentnode = global_node;
+    global_node = TraceNode(parent_pid);
 
     // Check status
 #ifdef DEBUG
     printf("\e[1;34m\tCheck status of pid \e[0;36m%s\e[0m\n", parent_pid);
 #endif
     char *statuspath;
-    asprintf(&statuspath, "/proc/%s/status", parent_pid);
+    if(asprintf(&statuspath, "%s/%s/status", ProcRoot(), parent_pid) < 0)
+    {
+        global_node = parentnode;
+        return RETVAL_ERROR;
+    }
+    global_pid = parent_pid;
     retval = CheckStatus(statuspath);
     free(statuspath);
-    if(retval != RETVAL_OK)
-        return retval;
+    if(global_node >= 0)
+        global_trace->nodes[global_node].statusns = Nanoseconds() - starttime;
 
     // For each task the child processes must be checked
-    char *taskdirpath;
-    asprintf(&taskdirpath, "/proc/%s/task", parent_pid);
-    retval = ForEachFileInDir(taskdirpath, ForEachTaskCallback);
-    free(taskdirpath);
+    if(retval == RETVAL_OK)
+    {
+        char *taskdirpath;
+        if(asprintf(&taskdirpath, "%s/%s/task", ProcRoot(), parent_pid) < 0)
+        {
+            retval = RETVAL_ERROR;
+        }
+        else
+        {
+            retval = ForEachFileInDir(taskdirpath, ForEachTaskCallback);
+            free(taskdirpath);
+        }
+    }
+
+    if(global_node >= 0)
+    {
+        long long totalns = Nanoseconds() - starttime;
+        global_trace->nodes[global_node].totalns = totalns;
+        if(parentnode >= 0)
+            global_trace->nodes[parentnode].childrenns += totalns;
+    }
+    global_node = parentnode;
     return retval;
 }
 
@@ -196,9 +492,29 @@ int ForEachTaskCallback(const char *dirpath, struct dirent *entry)
     // check children
     char *childlistpath;
     int retval;
-    asprintf(&childlistpath, "%s/%s/children", dirpath, entry->d_name);
-    retval = ForEachLineInFile(childlistpath, ForEachPIDLineCallback);
-    free(childlistpath);
+    if(DeadlineExceeded())
+        return RETVAL_ERROR;
+
+    // Children of the task get reached through it
+    const char *parentvia = global_via;
+    pid_t       parenttid = global_tid;
+    global_tid = (pid_t)atoi(entry->d_name);
+    global_via = "children";
+    if(global_node >= 0 && global_trace->nodes[global_node].pid != global_tid)
+        global_via = "task";
+
+    if(asprintf(&childlistpath, "%s/%s/children", dirpath, entry->d_name) < 0)
+    {
+        retval = RETVAL_ERROR;
+    }
+    else
+    {
+        retval = ForEachLineInFile(childlistpath, ForEachPIDLineCallback);
+        free(childlistpath);
+    }
+
+    global_via = parentvia;
+    global_tid = parenttid;
     return retval;
 }
 
@@ -206,16 +522,14 @@ int ForEachTaskCallback(const char *dirpath, struct dirent *entry)
 
 /*
  * This is a wrapper function to ForEachPIDCallback.
- * This callback gets called for each PID in the /proc/PARENTPID/task/PARENTTID/children
- * file.
- * The line containing a child PID gets trimmed (removing trailing space).
- * Then ForEachPIDCallback gets called with str=NULL, delimiters=NULL and parent_pid as the
- * child PID in the children file to recursively check those permissions 
+ * This callback gets called for each line in the /proc/PARENTPID/task/PARENTTID/children
+ * file. The kernel writes all child PIDs into one line, separated by a space.
+ * ForEachPIDCallback gets called for each of these PIDs to recursively check those permissions
  * and the permissions of those child processes
  *
  * Args:
  *  filename:   (not used) - path to the children file of a task
- *  line:       One line of the children file containing one PID of a child
+ *  line:       One line of the children file containing the PIDs of the children
  *  linelength: (not used) - length of the line in bytes
  *  linenumber: (not used) - number of the line starting by 1
  *
@@ -224,25 +538,9 @@ int ForEachTaskCallback(const char *dirpath, struct dirent *entry)
  */
 int ForEachPIDLineCallback(const char *filename, const char *line, size_t linelength, size_t linenumber)
 {
-    // remove trailing spaces
-    char *pid;
-    pid = (char*)malloc(sizeof(char)*linelength);
-    if(pid == NULL)
-    {
-        fprintf(stderr, "\e[1;31mmalloc(%lu); failed with error: ", sizeof(char)*linelength);
-        fprintf(stderr, "\e[1;31m%s\e[0m\n", strerror(errno));
-        return -1;
-    }
-
-    strncpy(pid, line, linelength);
-
-    while(pid[linelength-1] == ' ')
-        pid[--linelength] = '\0';
-
     // check the childs permissions
     int retval;
-    retval = ForEachPIDCallback(NULL, NULL, (const char*)pid);
-    free(pid);
+    retval = ForEachTokenInString(line, " ", ForEachPIDCallback);
     return retval;
 }
 
@@ -317,15 +615,176 @@ int ForEachStatusLineCallback(const char *filename, const char *line, size_t lin
         uid_t id;
         if(tmp[0] == 'U') id = global_uid;
         if(tmp[0] == 'G') id = global_gid;
+
+        struct CHECKNODE *node = NULL;
+        if(global_node >= 0)
+        {
+            node = &global_trace->nodes[global_node];
+            uid_t *ids = tmp[0] == 'U' ? node->uid : node->gid;
+            ids[0] = real;
+            ids[1] = eff;
+            ids[2] = saved;
+            ids[3] = fs;
+            if(tmp[0] == 'U')
+                node->hasuid = true;
+            else
+                node->hasgid = true;
+        }
+
         if(real != id || eff != id || saved != id || fs != id)
         {
-            fprintf(stderr, "\e[1;31mPermission denied - One process on destination PTS has different privileges!\e[0m\n");
+            if(global_showpids)
+                fprintf(stderr, "\e[1;31mPermission denied - Process %s on destination PTS has different privileges!\e[0m\n", global_pid);
+            else
+                fprintf(stderr, "\e[1;31mPermission denied - One process on destination PTS has different privileges!\e[0m\n");
+            if(node)
+            {
+                node->denied = true;
+                global_trace->deniednode = global_node;
+            }
             return RETVAL_UNSECURE;
         }
 
+        // The kernel shows IDs that are not mapped into our user namespace as overflow ID.
+        // If the caller has that ID as well, the match says nothing.
+        uid_t overflow = tmp[0] == 'U' ? OverflowUID() : OverflowGID();
+        if(id == overflow && !HasMappedCredentials((pid_t)atoi(global_pid)))
+        {
+            if(global_showpids)
+                fprintf(stderr, "\e[1;31mPermission denied - Process %s on destination PTS has IDs that are not mapped into the user namespace of onpts!\e[0m\n", global_pid);
+            else
+                fprintf(stderr, "\e[1;31mPermission denied - One process on destination PTS has IDs that are not mapped into the user namespace of onpts!\e[0m\n");
+            if(node)
+            {
+                node->denied = true;
+                global_trace->deniednode = global_node;
+            }
+            return RETVAL_UNSECURE;
+        }
+    }
+    else if(strncmp(line, "NSpid:", 6) == 0 && global_node >= 0)
+    {
+        // The last PID is the one inside the innermost PID namespace, for example of a container
+        const char *last = strrchr(line, '\t');
+        if(last != NULL)
+            global_trace->nodes[global_node].nspid = (pid_t)atoi(last + 1);
     }
     return RETVAL_OK;
 }
 
+
+
+/*
+ * Checks if the time limit of the check ran out.
+ */
+static bool DeadlineExceeded(void)
+{
+    if(Nanoseconds() < global_deadline)
+        return false;
+
+    global_timedout = true;
+    return true;
+}
+
+
+
+/*
+ * Arms the watchdog timer. After the given time, WatchdogHandler gets called.
+ * A time of 0 disarms the watchdog.
+ */
+static void ArmWatchdog(long milliseconds)
+{
+    if(!global_watchdogcreated)
+    {
+        if(milliseconds == 0)
+            return;
+
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = WatchdogHandler;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGALRM, &action, NULL);
+
+        struct sigevent event;
+        memset(&event, 0, sizeof(event));
+        event.sigev_notify = SIGEV_SIGNAL;
+        event.sigev_signo  = SIGALRM;
+        if(timer_create(CLOCK_MONOTONIC, &event, &global_watchdog) != 0)
+        {
+            fprintf(stderr, "\e[1;31mtimer_create failed with error: ");
+            fprintf(stderr, "%s\e[0m\n", strerror(errno));
+            return; // The soft deadline still applies
+        }
+        global_watchdogcreated = true;
+    }
+
+    struct itimerspec timeout;
+    memset(&timeout, 0, sizeof(timeout));
+    timeout.it_value.tv_sec  = milliseconds / 1000;
+    timeout.it_value.tv_nsec = (milliseconds % 1000) * 1000000L;
+    timer_settime(global_watchdog, 0, &timeout, NULL);
+}
+
+
+
+/*
+ * The check is stuck in a blocking read. Nothing was written to the PTS yet,
+ * so terminating onpts is the safe way out.
+ */
+static void WatchdogHandler(int signum)
+{
+    static const char message[] = "\e[1;31mPermission denied - Privilege check timed out!\e[0m\n";
+
+    if(global_timeouthook)
+        global_timeouthook();
+    if(write(STDERR_FILENO, message, sizeof(message) - 1) < 0)
+        _exit(EXIT_FAILURE);
+    _exit(EXIT_FAILURE);
+}
+
+
+
+/*
+ * Adds a node for the process with the given PID to the trace.
+ * The node gets linked to the node of the process that is currently checked.
+ *
+ * Returns:
+ *  The index of the new node, or -1 if nothing gets traced
+ */
+static long TraceNode(const char *pid)
+{
+    if(global_trace == NULL)
+        return -1;
+
+    if(global_trace->numnodes == global_trace->capacity)
+    {
+        struct CHECKNODE *nodes;
+        size_t capacity = global_trace->capacity ? global_trace->capacity * 2 : 64;
+        nodes = (struct CHECKNODE*)realloc(global_trace->nodes, capacity * sizeof(struct CHECKNODE));
+        if(nodes == NULL)
+            return -1;  // The check itself does not depend on the trace
+        global_trace->nodes    = nodes;
+        global_trace->capacity = capacity;
+    }
+
+    long index = global_trace->numnodes++;
+    struct CHECKNODE *node = &global_trace->nodes[index];
+    memset(node, 0, sizeof(struct CHECKNODE));
+    node->pid    = (pid_t)atoi(pid);
+    node->parent = global_node;
+    node->via    = global_via;
+    node->tid    = strcmp(global_via, "pts") == 0 ? 0 : global_tid;
+    return index;
+}
+
+
+
+static long long Nanoseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
 // vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
 
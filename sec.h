@@ -19,8 +19,58 @@
 #define ONPTS_SEC_H
 
 #include <sys/types.h>
+#include <stdbool.h>
 
-int CheckPrivileges(const char* pty_path, uid_t uid, gid_t gid);
+/*
+ * One process visited by CheckPrivileges
+ */
+struct CHECKNODE
+{
+    pid_t       pid;
+    pid_t       nspid;      // PID in the innermost PID namespace of the process (NSpid), 0 if unknown
+    long        parent;     // Index of the node this process was reached from, -1 for processes on the PTS
+    const char *via;        // "pts": attached to the PTS, "children": child of the main thread, "task": child of another task
+    pid_t       tid;        // Task whose children file listed this process
+    bool        hasuid;     // false if the Uid line was not read
+    bool        hasgid;     // false if the Gid line was not read
+    uid_t       uid[4];
+    gid_t       gid[4];
+    bool        denied;     // This process caused the denial
+    long long   statusns;   // Time spent reading /proc/$PID/status
+    long long   totalns;    // Time spent on this process and all its descendants
+    long long   childrenns; // Part of totalns spent on the descendants
+};
+
+/*
+ * Everything CheckPrivileges did during one check
+ */
+struct CHECKTRACE
+{
+    struct CHECKNODE *nodes;
+    size_t    numnodes;
+    size_t    capacity;
+    long      deniednode;   // Index of the node that caused the denial, -1 if none
+    long long discoveryns;  // Time spent finding the processes on the PTS
+    long long totalns;      // Time of the whole check
+    bool      timedout;     // The check did not finish before its deadline
+};
+
+#ifndef CHECK_DEADLINE_MS
+#define CHECK_DEADLINE_MS   2000    // Default time limit of CheckPrivileges, can be set at build time
+#endif
+#define CHECK_WATCHDOG_GRACE_MS 100 // The watchdog terminates onpts this long after the deadline
+
+struct PROCTABLE;
+
+int  CheckPrivileges(const char* pty_path, uid_t uid, gid_t gid);
+void SetCheckDeadline(long milliseconds);
+void SetCheckTimeoutHook(void (*hook)(void));
+
+int  DropPrivileges(void);
+int  RegainPrivileges(void);
+void SetCheckTrace(struct CHECKTRACE *trace);
+void SetCheckSnapshot(const struct PROCTABLE *table);
+void FreeCheckTrace(struct CHECKTRACE *trace);
 
 #endif
 
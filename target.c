@@ -0,0 +1,324 @@
+/*
+ * onpts is a too to securely access the input buffer of other pseudo terminals
+ * Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <fein/fein.h>
+#include "onpts.h"
+#include "proc.h"
+#include "sec.h"
+#include "target.h"
+
+static struct TARGET *parsed_targets;
+static size_t         parsed_count;
+
+static int ForEachTargetCallback(const char *list, const char *delimiters, const char *ptsnum);
+static unsigned long long Fingerprint(const struct PROCTABLE *table, const size_t *indices, size_t count);
+static int  CollectFingerprint(const struct PROCTABLE *table, const struct TARGET *target, unsigned long long *fingerprint, size_t **indices, size_t *count);
+static int CompareIndices(const void *a, const void *b);
+
+
+/*
+ * This function parses a comma separated list of PTS numbers like "2,3,7".
+ * Each PTS gets checked by CheckPTS, so the callers own PTS cannot be a target.
+ *
+ * Args:
+ *  list:       comma separated PTS numbers
+ *  targets:    Returns an allocated array of targets that must be released by FreeTargets
+ *  count:      Returns the number of targets
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int ParseTargets(const char *list, struct TARGET **targets, size_t *count)
+{
+    parsed_targets = NULL;
+    parsed_count   = 0;
+
+    if(ForEachTokenInString(list, ",", ForEachTargetCallback) != 0 || parsed_count == 0)
+    {
+        if(parsed_count == 0)
+            fprintf(stderr, "\e[1;31mNo PTS given in \"%s\"!\e[0m\n", list);
+        FreeTargets(parsed_targets, parsed_count);
+        return -1;
+    }
+
+    *targets = parsed_targets;
+    *count   = parsed_count;
+    return 0;
+}
+
+
+
+void FreeTargets(struct TARGET *targets, size_t count)
+{
+    if(targets == NULL)
+        return;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        free((void*)targets[i].ptspath);
+        free(targets[i].pids);
+    }
+    free(targets);
+}
+
+
+
+/*
+ * This function updates the state of all targets using a process table.
+ * If the set of processes on a PTS did not change since the last call,
+ * the verdict of CheckPermissions gets reused.
+ * Otherwise the full check gets done again.
+ *
+ * Args:
+ *  targets:    The targets to update
+ *  count:      Number of targets
+ *  table:      A fresh snapshot of all processes made by ScanProcesses
+ *
+ * Returns:
+ *  0 on success, -1 on error
+ */
+int UpdateTargets(struct TARGET *targets, size_t count, const struct PROCTABLE *table)
+{
+    // All targets that need a check share the snapshot instead of scanning the procfs once each
+    SetCheckSnapshot(table);
+    for(size_t i = 0; i < count; i++)
+    {
+        struct TARGET *target = &targets[i];
+        int    ptsnum = atoi(target->ptsnum);
+        size_t *indices;
+        size_t numindices;
+        unsigned long long fingerprint;
+        if(CollectFingerprint(table, target, &fingerprint, &indices, &numindices) != 0)
+        {
+            SetCheckSnapshot(NULL);
+            return -1;
+        }
+
+        target->shellforeground = false;
+        for(size_t n = 0; n < numindices; n++)
+        {
+            const struct PROCINFO *proc = &table->procs[indices[n]];
+            if(proc->ctty == ptsnum && proc->pid == proc->sid)
+                target->shellforeground = (proc->tpgid == proc->pgrp);
+        }
+
+        // Remember the processes, so that TargetsChanged only has to look at them
+        pid_t *pids = (pid_t*)realloc(target->pids, (numindices + 1) * sizeof(pid_t));
+        if(pids == NULL)
+        {
+            fprintf(stderr, "\e[1;31mAllocating memory for the process list failed with error: ");
+            fprintf(stderr, "%s\e[0m\n", strerror(errno));
+            free(indices);
+            SetCheckSnapshot(NULL);
+            return -1;
+        }
+        for(size_t n = 0; n < numindices; n++)
+            pids[n] = table->procs[indices[n]].pid;
+        target->pids    = pids;
+        target->numpids = numindices;
+        free(indices);
+
+        if(target->checked && target->fingerprint == fingerprint)
+            continue;
+
+#ifdef DEBUG
+        printf("\e[1;34mProcesses on \e[0;36m%s\e[1;34m changed, checking privileges\e[0m\n", target->ptspath);
+#endif
+        target->verdict     = CheckPermissions(target->ptspath);
+        target->fingerprint = fingerprint;
+        target->checked     = true;
+    }
+    SetCheckSnapshot(NULL);
+    return 0;
+}
+
+
+
+/*
+ * This function checks if the processes on any target changed since the last UpdateTargets call,
+ * without scanning all of /proc.
+ * Only the processes that were on the targets, and their descendants get read.
+ * This detects new children (like a sudo started by the shell), processes that exec'ed
+ * with other credentials and processes that left or exited.
+ * A process that attached to a PTS from outside that process tree is not detected,
+ * so a full scan with UpdateTargets is still necessary once in a while.
+ *
+ * Args:
+ *  targets:    The targets to check
+ *  count:      Number of targets
+ *
+ * Returns:
+ *  1 if a target changed or was never checked, 0 if nothing changed, -1 on error
+ */
+int TargetsChanged(const struct TARGET *targets, size_t count)
+{
+    size_t numpids = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        if(!targets[i].checked)
+            return 1;
+        numpids += targets[i].numpids;
+    }
+
+    pid_t *pids = (pid_t*)calloc(numpids + 1, sizeof(pid_t));
+    if(pids == NULL)
+    {
+        fprintf(stderr, "\e[1;31mAllocating memory for the process list failed with error: ");
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        return -1;
+    }
+    numpids = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        if(targets[i].numpids == 0)
+            continue;
+        memcpy(pids + numpids, targets[i].pids, targets[i].numpids * sizeof(pid_t));
+        numpids += targets[i].numpids;
+    }
+
+    struct PROCTABLE table;
+    int retval = ScanProcessTree(&table, pids, numpids, PROC_SCAN_ALL);
+    free(pids);
+    if(retval != 0)
+        return -1;
+
+    for(size_t i = 0; i < count && retval == 0; i++)
+    {
+        unsigned long long fingerprint;
+        size_t *indices;
+        size_t numindices;
+        if(CollectFingerprint(&table, &targets[i], &fingerprint, &indices, &numindices) != 0)
+        {
+            retval = -1;
+            break;
+        }
+        free(indices);
+        if(fingerprint != targets[i].fingerprint)
+        {
+#ifdef DEBUG
+            printf("\e[1;34mProcesses on \e[0;36m%s\e[1;34m changed\e[0m\n", targets[i].ptspath);
+#endif
+            retval = 1;
+        }
+    }
+    FreeProcesses(&table);
+    return retval;
+}
+
+
+
+static int ForEachTargetCallback(const char *list, const char *delimiters, const char *ptsnum)
+{
+    if(CheckPTSNumber(ptsnum))
+        return -1;
+
+    // Ignore duplicates
+    for(size_t i = 0; i < parsed_count; i++)
+        if(strcmp(parsed_targets[i].ptsnum, ptsnum) == 0)
+            return 0;
+
+    struct TARGET *targets;
+    targets = (struct TARGET*)realloc(parsed_targets, (parsed_count + 1) * sizeof(struct TARGET));
+    if(targets == NULL)
+    {
+        fprintf(stderr, "\e[1;31mAllocating memory for the target list failed with error: ");
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        return -1;
+    }
+    parsed_targets = targets;
+
+    struct TARGET *target = &parsed_targets[parsed_count];
+    memset(target, 0, sizeof(struct TARGET));
+    strncpy(target->ptsnum, ptsnum, sizeof(target->ptsnum) - 1);
+
+    if(GetPTSPath(target->ptsnum, &target->ptspath))
+        return -1;
+    parsed_count++;
+
+    // Check if the PTS is valid, or the same pts onpts was executed on (this is forbidden)
+    if(CheckPTS(target->ptspath))
+        return -1;
+
+    return 0;
+}
+
+
+
+/*
+ * FNV-1a hash over the identity and credentials of each process.
+ * (PID, start time) identifies a process even when PIDs get reused.
+ * The credentials are included because a process can change them by exec (su, sudo, …).
+ */
+static unsigned long long Fingerprint(const struct PROCTABLE *table, const size_t *indices, size_t count)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for(size_t n = 0; n < count; n++)
+    {
+        const struct PROCINFO *proc = &table->procs[indices[n]];
+        unsigned long long values[11];
+        values[0] = (unsigned long long)proc->pid;
+        values[1] = proc->starttime;
+        for(int i = 0; i < 4; i++)
+        {
+            values[2 + i] = proc->uid[i];
+            values[6 + i] = proc->gid[i];
+        }
+        values[10] = proc->valid;
+
+        const unsigned char *bytes = (const unsigned char*)values;
+        for(size_t b = 0; b < sizeof(values); b++)
+        {
+            hash ^= bytes[b];
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+
+
+/*
+ * Collects the processes of a target and computes their fingerprint.
+ * The indices get sorted, so the fingerprint does not depend on the order the processes were found in.
+ */
+static int CollectFingerprint(const struct PROCTABLE *table, const struct TARGET *target, unsigned long long *fingerprint, size_t **indices, size_t *count)
+{
+    if(CollectPTSProcesses(table, atoi(target->ptsnum), indices, count) != 0)
+        return -1;
+
+    qsort(*indices, *count, sizeof(size_t), CompareIndices);
+    *fingerprint = Fingerprint(table, *indices, *count);
+    return 0;
+}
+
+
+
+static int CompareIndices(const void *a, const void *b)
+{
+    size_t indexa = *(const size_t*)a;
+    size_t indexb = *(const size_t*)b;
+    return (indexa > indexb) - (indexa < indexb);
+}
+
+// vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
@@ -0,0 +1,49 @@
+/*
+ * onpts is a too to securely access the input buffer of other pseudo terminals
+ * Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ONPTS_TARGET_H
+#define ONPTS_TARGET_H
+
+#include <stdbool.h>
+#include "proc.h"
+
+/*
+ * A PTS that gets written to repeatedly by a long running mode like --follow-cwd.
+ * The privilege verdict of CheckPermissions is only valid for the set of processes
+ * it was computed for. The fingerprint identifies that set.
+ */
+struct TARGET
+{
+    char        ptsnum[8];
+    const char *ptspath;
+    bool        checked;        // false until CheckPermissions was called once
+    int         verdict;        // return value of CheckPermissions
+    unsigned long long fingerprint;
+    pid_t      *pids;           // The processes the fingerprint was computed for, see TargetsChanged
+    size_t      numpids;
+    bool        shellforeground; // true if the session leader (the shell) is in the foreground
+};
+
+int  ParseTargets(const char *list, struct TARGET **targets, size_t *count);
+void FreeTargets(struct TARGET *targets, size_t count);
+int  UpdateTargets(struct TARGET *targets, size_t count, const struct PROCTABLE *table);
+int  TargetsChanged(const struct TARGET *targets, size_t count);
+
+#endif
+
+// vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
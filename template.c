@@ -0,0 +1,401 @@
+/*
+ * onpts is a too to securely access the input buffer of other pseudo terminals
+ * Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "sec.h"
+#include "template.h"
+
+/*
+ * Placeholders
+ *
+ *  {cwd}           Working directory of the caller
+ *  {env:VAR}       Environment variable VAR of the caller
+ *  {file:PATH}     Content of the file PATH without a trailing line break, read as the caller
+ *
+ * Each value gets inserted in single quotes, so the shell on the other PTS takes it as one word.
+ * Values with control characters get refused: The line discipline of the PTS would act on them
+ * (a line break submits the line, Ctrl-C sends SIGINT) before the shell sees the quotes.
+ * A {…} that is none of the above gets sent as it is.
+ */
+
+struct COMMANDBUFFER
+{
+    char  *data;
+    size_t length;
+    size_t capacity;
+};
+
+static int  ExpandPlaceholder(struct COMMANDBUFFER *buffer, const char *name, size_t namelength, unsigned int flags);
+static int  AppendValue(struct COMMANDBUFFER *buffer, const char *value, const char *name, size_t namelength, unsigned int flags);
+static int  Append(struct COMMANDBUFFER *buffer, const char *data, size_t length);
+static char *ReadFileAsCaller(const char *path);
+static char *ReadLimited(int fd, size_t limit, ssize_t *length);
+
+
+/*
+ * Joins the arguments with a single space in between.
+ * The buffer gets allocated once with enough space for all arguments,
+ * and TEMPLATE_RESERVE bytes for the values of placeholders.
+ *
+ * Args:
+ *  args:       The arguments
+ *  numargs:    Number of arguments
+ *  flags:      Combination of TEMPLATE_* flags
+ *  command:    Gets the command, terminated by '\0'. Must be freed by the caller.
+ *
+ * Returns:
+ *  0 on success, -1 on error. An error message gets printed in that case.
+ */
+int BuildCommand(char * const *args, int numargs, unsigned int flags, char **command)
+{
+    struct COMMANDBUFFER buffer;
+    buffer.length   = 0;
+    buffer.capacity = 2;    // "\n\0"
+    if(flags & TEMPLATE_EXPAND)
+        buffer.capacity += TEMPLATE_RESERVE;
+    for(int i = 0; i < numargs; i++)
+        buffer.capacity += strlen(args[i]) + 1;
+
+    buffer.data = (char*)malloc(buffer.capacity);
+    if(buffer.data == NULL)
+    {
+        fprintf(stderr, "\e[1;31mAllocating memory for command argument failed with error: ");
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+        return -1;
+    }
+
+    int retval = 0;
+    for(int i = 0; i < numargs && retval == 0; i++)
+    {
+        if(i > 0)
+            retval = Append(&buffer, " ", 1);
+
+        const char *c = args[i];
+        while(*c && retval == 0)
+        {
+            if((flags & TEMPLATE_EXPAND) && *c == '{')
+            {
+                const char *end = strchr(c, '}');
+                if(end)
+                {
+                    int expanded = ExpandPlaceholder(&buffer, c + 1, end - c - 1, flags);
+                    if(expanded < 0)
+                        retval = -1;
+                    if(expanded != 0)
+                    {
+                        c = end + 1;
+                        continue;
+                    }
+                }
+            }
+
+            // Everything up to the next possible placeholder
+            const char *next;
+            if(flags & TEMPLATE_EXPAND)
+                next = strchrnul(c + 1, '{');
+            else
+                next = c + strlen(c);
+            retval = Append(&buffer, c, next - c);
+            c = next;
+        }
+    }
+
+    if(retval == 0 && (flags & TEMPLATE_LINEBREAK))
+        retval = Append(&buffer, "\n", 1);
+    if(retval == 0)
+        retval = Append(&buffer, "", 1);
+
+    if(retval != 0)
+    {
+        free(buffer.data);
+        return -1;
+    }
+
+#ifdef DEBUG
+    printf("\e[1;34mCommand: \e[0;36m%zu bytes in a buffer of %zu\e[0m\n", buffer.length - 1, buffer.capacity);
+#endif
+    *command = buffer.data;
+    return 0;
+}
+
+
+
+/*
+ * Puts a string into single quotes. Single quotes inside the string become '\''
+ */
+char *QuoteForShell(const char *string)
+{
+    size_t length = 3;  // two quotes and "\0"
+    for(const char *c = string; *c; c++)
+        length += *c == '\'' ? 4 : 1;
+
+    char *quoted;
+    quoted = (char*)malloc(length);
+    if(quoted == NULL)
+        return NULL;
+
+    char *out = quoted;
+    *out++ = '\'';
+    for(const char *c = string; *c; c++)
+    {
+        if(*c == '\'')
+        {
+            memcpy(out, "'\\''", 4);
+            out += 4;
+        }
+        else
+            *out++ = *c;
+    }
+    *out++ = '\'';
+    *out   = '\0';
+    return quoted;
+}
+
+
+
+/*
+ * Returns:
+ *  1 if the placeholder got replaced by its value, 0 if name is no placeholder, -1 on error
+ */
+static int ExpandPlaceholder(struct COMMANDBUFFER *buffer, const char *name, size_t namelength, unsigned int flags)
+{
+    char *value = NULL;
+
+    if(namelength == 3 && strncmp(name, "cwd", 3) == 0)
+    {
+        value = getcwd(NULL, 0);
+        if(value == NULL)
+        {
+            fprintf(stderr, "\e[1;31mGetting the working directory failed with error: ");
+            fprintf(stderr, "%s\e[0m\n", strerror(errno));
+            return -1;
+        }
+    }
+    else if(namelength > 4 && strncmp(name, "env:", 4) == 0)
+    {
+        char *variable = strndup(name + 4, namelength - 4);
+        if(variable == NULL)
+            return -1;
+        const char *content = getenv(variable);
+        if(content == NULL)
+        {
+            fprintf(stderr, "\e[1;31mEnvironment variable %s is not set!\e[0m\n", variable);
+            free(variable);
+            return -1;
+        }
+        free(variable);
+        value = strdup(content);
+    }
+    else if(namelength > 5 && strncmp(name, "file:", 5) == 0)
+    {
+        char *path = strndup(name + 5, namelength - 5);
+        if(path == NULL)
+            return -1;
+        value = ReadFileAsCaller(path);
+        free(path);
+        if(value == NULL)
+            return -1;
+
+        size_t length = strlen(value);
+        if(length > 0 && value[length - 1] == '\n')
+            value[length - 1] = '\0';
+    }
+    else
+        return 0;
+
+    if(value == NULL)
+        return -1;
+
+    int retval;
+    retval = AppendValue(buffer, value, name, namelength, flags);
+    free(value);
+    return retval == 0 ? 1 : -1;
+}
+
+
+
+static int AppendValue(struct COMMANDBUFFER *buffer, const char *value, const char *name, size_t namelength, unsigned int flags)
+{
+    for(const unsigned char *c = (const unsigned char*)value; *c; c++)
+    {
+        if(*c < 0x20 || *c == 0x7f)
+        {
+            fprintf(stderr, "\e[1;31mThe value of {%.*s} contains control characters!\e[0m\n", (int)namelength, name);
+            return -1;
+        }
+    }
+
+    char *quoted = QuoteForShell(value);
+    if(quoted == NULL)
+        return -1;
+
+    int retval = 0;
+    const char *c = quoted;
+    while(*c && retval == 0)
+    {
+        if((flags & TEMPLATE_MACRO) && *c == '<')
+        {
+            retval = Append(buffer, "<lt>", 4);
+            c++;
+            continue;
+        }
+        const char *next = (flags & TEMPLATE_MACRO) ? strchrnul(c, '<') : c + strlen(c);
+        retval = Append(buffer, c, next - c);
+        c = next;
+    }
+    free(quoted);
+    return retval;
+}
+
+
+
+/*
+ * The buffer only grows if the values of the placeholders do not fit into TEMPLATE_RESERVE
+ */
+static int Append(struct COMMANDBUFFER *buffer, const char *data, size_t length)
+{
+    if(buffer->length + length > buffer->capacity)
+    {
+        size_t capacity = buffer->capacity * 2;
+        while(capacity < buffer->length + length)
+            capacity *= 2;
+
+        char *bigger;
+        bigger = (char*)realloc(buffer->data, capacity);
+        if(bigger == NULL)
+        {
+            fprintf(stderr, "\e[1;31mAllocating memory for command argument failed with error: ");
+            fprintf(stderr, "%s\e[0m\n", strerror(errno));
+            return -1;
+        }
+        buffer->data     = bigger;
+        buffer->capacity = capacity;
+    }
+    memcpy(&buffer->data[buffer->length], data, length);
+    buffer->length += length;
+    return 0;
+}
+
+
+
+/*
+ * onpts may run with the suid bit set, so the file gets read with the privileges of the caller.
+ * Only regular files up to TEMPLATE_MAX_FILESIZE get read.
+ * The file gets opened once, and checked and read through that descriptor,
+ * so it cannot be replaced between the check and the read.
+ * Symbolic links get refused, and opening does not block on FIFOs or devices.
+ *
+ * Returns:
+ *  The content of the file, terminated by '\0', or NULL on error
+ */
+static char *ReadFileAsCaller(const char *path)
+{
+    if(DropPrivileges() != 0)
+        return NULL;
+
+    char   *data   = NULL;
+    ssize_t length = 0;
+    struct stat info;
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if(fd < 0 && errno == ELOOP)
+    {
+        fprintf(stderr, "\e[1;31m%s is a symbolic link!\e[0m\n", path);
+    }
+    else if(fd < 0 || fstat(fd, &info) != 0)
+    {
+        fprintf(stderr, "\e[1;31mReading %s failed with error: ", path);
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+    }
+    else if(!S_ISREG(info.st_mode) || info.st_size > TEMPLATE_MAX_FILESIZE)
+    {
+        fprintf(stderr, "\e[1;31m%s is not a regular file of at most %d bytes!\e[0m\n", path, TEMPLATE_MAX_FILESIZE);
+    }
+    else if((data = ReadLimited(fd, TEMPLATE_MAX_FILESIZE + 1, &length)) == NULL)
+    {
+        fprintf(stderr, "\e[1;31mReading %s failed with error: ", path);
+        fprintf(stderr, "%s\e[0m\n", strerror(errno));
+    }
+    else if(length > TEMPLATE_MAX_FILESIZE)
+    {
+        // The file grew after fstat
+        fprintf(stderr, "\e[1;31m%s is not a regular file of at most %d bytes!\e[0m\n", path, TEMPLATE_MAX_FILESIZE);
+        free(data);
+        data = NULL;
+    }
+    else if(strlen(data) != (size_t)length)
+    {
+        fprintf(stderr, "\e[1;31m%s contains a null byte!\e[0m\n", path);
+        free(data);
+        data = NULL;
+    }
+    if(fd >= 0)
+        close(fd);
+
+    if(RegainPrivileges() != 0)
+    {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+
+
+/*
+ * Reads from fd until the end of the file, but never more than limit bytes.
+ *
+ * Returns:
+ *  The bytes read, terminated by '\0', or NULL on error. errno is set in that case.
+ */
+static char *ReadLimited(int fd, size_t limit, ssize_t *length)
+{
+    char *data = (char*)malloc(limit + 1);
+    if(data == NULL)
+        return NULL;
+
+    size_t size = 0;
+    while(size < limit)
+    {
+        ssize_t n = read(fd, data + size, limit - size);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+        {
+            int error = errno;
+            free(data);
+            errno = error;
+            return NULL;
+        }
+        if(n == 0)
+            break;
+        size += n;
+    }
+    data[size] = '\0';
+    *length = size;
+    return data;
+}
+
+// vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
@@ -0,0 +1,34 @@
+/*
+ * onpts is a too to securely access the input buffer of other pseudo terminals
+ * Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ONPTS_TEMPLATE_H
+#define ONPTS_TEMPLATE_H
+
+#define TEMPLATE_EXPAND         0x01    // Replace {cwd}, {env:VAR} and {file:PATH}
+#define TEMPLATE_MACRO          0x02    // The command is a macro, a < in a value becomes <lt>
+#define TEMPLATE_LINEBREAK      0x04    // Append a line break
+
+#define TEMPLATE_RESERVE        1024    // Bytes preallocated for the values of placeholders
+#define TEMPLATE_MAX_FILESIZE   65536   // Largest file {file:PATH} reads
+
+int   BuildCommand(char * const *args, int numargs, unsigned int flags, char **command);
+char *QuoteForShell(const char *string);
+
+#endif
+
+// vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
@@ -0,0 +1,105 @@
+#!/usr/bin/env bash
+
+# Verifies and benchmarks CheckPrivileges using synthetic procfs trees.
+# Run ./build.sh in this directory first.
+#
+# Usage: ./bench.sh [ITERATIONS]
+
+cd "$(dirname "$0")"
+
+ITERATIONS=${1:-10}
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+FAILED=0
+
+# Expect VERDICT NAME MKPROCFS-ARGS…
+function Expect
+{
+    local expected=$1
+    local name=$2
+    shift 2
+
+    ./mkprocfs "$WORKDIR/$name" "$@" || exit 1
+    ./benchcheck "$WORKDIR/$name" 1 1000 1000 1 > /dev/null 2>&1
+    local retval=$?
+
+    local verdict="allow"
+    if [[ $retval -eq 1 ]] ; then
+        verdict="deny"
+    elif [[ $retval -ne 0 ]] ; then
+        verdict="error"
+    fi
+
+    if [[ $verdict == $expected ]] ; then
+        echo -e "\e[1;32m✔ \e[1;34m$name\e[0m"
+    else
+        echo -e "\e[1;31m✘ \e[1;34m$name: \e[1;31mexpected $expected, got $verdict\e[0m"
+        FAILED=1
+    fi
+    rm -rf "$WORKDIR/$name"
+}
+
+# Measure NAME MKPROCFS-ARGS…
+function Measure
+{
+    local name=$1
+    shift
+
+    ./mkprocfs "$WORKDIR/$name" "$@" || exit 1
+    printf "%-24s " "$name"
+    ./benchcheck "$WORKDIR/$name" 1 1000 1000 $ITERATIONS 2> /dev/null
+    rm -rf "$WORKDIR/$name"
+}
+
+
+echo -e "\e[1;37mCorrectness\e[0m"
+Expect allow "clean tree"           -n 50  -w 3 -t 2
+Expect allow "background processes" -n 50  -w 3 -b 100
+Expect allow "no process on PTS"    -n 10  -p 2
+Expect allow "wide tree"            -n 200 -w 100
+for field in 0 1 2 3 ; do
+    Expect deny "uid[$field] of leader"  -n 50 -w 3 -U 0  -f $field
+    Expect deny "gid[$field] of leader"  -n 50 -w 3 -G 0  -f $field
+done
+Expect deny  "uid in the middle"    -n 50  -w 3 -U 10
+Expect deny  "gid of a leaf"        -n 50  -w 3 -G 49
+Expect deny  "uid in second task"   -n 50  -w 3 -t 3 -U 2
+Expect deny  "gid in third task"    -n 50  -w 3 -t 3 -G 3
+Expect deny  "uid at end of chain"  -n 200 -w 1 -U 199
+Expect deny  "uid among siblings"   -n 200 -w 100 -U 150
+
+echo -e "\e[1;37mScaling ($ITERATIONS iterations, 1000 background processes)\e[0m"
+for n in 10 100 1000 5000 ; do
+    Measure "wide n=$n"     -n $n -w 16 -b 1000
+done
+for n in 10 100 500 ; do
+    Measure "deep n=$n"     -n $n -w 1  -b 1000
+done
+for n in 10 100 1000 ; do
+    Measure "threaded n=$n" -n $n -w 4  -t 4 -b 1000
+done
+
+echo -e "\e[1;37mAudit log (records per writer: $((ITERATIONS * 1000)))\e[0m"
+for writers in 1 4 16 ; do
+    printf "%-24s " "writers=$writers"
+    ./benchaudit "$WORKDIR/audit.ring" $writers $((ITERATIONS * 1000))
+    if [[ $? -ne 0 ]] ; then
+        echo -e "\e[1;31m✘ audit log broken with $writers writers\e[0m"
+        FAILED=1
+    fi
+done
+
+echo -e "\e[1;37mPTS lock (rounds per process: $((ITERATIONS * 100)))\e[0m"
+for processes in 1 4 16 ; do
+    printf "%-24s " "processes=$processes"
+    ./benchlock "$WORKDIR" $processes $((ITERATIONS * 100))
+    if [[ $? -ne 0 ]] ; then
+        echo -e "\e[1;31m✘ PTS lock not exclusive with $processes processes\e[0m"
+        FAILED=1
+    fi
+done
+
+exit $FAILED
+
+# vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
@@ -0,0 +1,223 @@
+/*
+ * onpts is a too to securely access the input buffer of other pseudo terminals
+ * Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * benchaudit appends records to an audit log from several processes at the same time.
+ * It measures the latency of AuditWrite and verifies that no record got lost or torn.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "audit.h"
+
+#define EXIT_OK     0
+#define EXIT_BROKEN 1
+#define EXIT_USAGE  2
+
+void PrintHelp(char *pname)
+{
+    fprintf(stderr, "\e[1;37mUsage: \e[1;36m%s\e[1;34m LOGFILE WRITERS RECORDS\e[0m\n", pname);
+    fprintf(stderr, "Each of the WRITERS processes appends RECORDS records to LOGFILE (it gets replaced).\n");
+    fprintf(stderr, "Exit code: %d if all records are valid, %d if not, %d on usage errors\n",
+            EXIT_OK, EXIT_BROKEN, EXIT_USAGE);
+}
+
+
+
+static int CompareLongLong(const void *a, const void *b)
+{
+    long long lla = *(const long long*)a;
+    long long llb = *(const long long*)b;
+    return (lla > llb) - (lla < llb);
+}
+
+
+
+/*
+ * Appends the records and writes "median p99 max" in ns to the pipe
+ */
+static void Writer(int writer, int records, int pipefd)
+{
+    long long *durations = (long long*)malloc(records * sizeof(long long));
+    if(durations == NULL)
+        exit(EXIT_BROKEN);
+
+    struct AUDITRECORD record;
+    for(int i = 0; i < records; i++)
+    {
+        AuditBegin(&record, AUDIT_MODE_COMMAND, "/dev/pts/1");
+        record.payloadsize = writer;    // Lets the verification find torn records
+        record.payloadhash = i;
+        record.numprocs    = writer ^ i;
+
+        long long starttime = AuditClock();
+        if(AuditWrite(&record) != 0)
+            exit(EXIT_BROKEN);
+        durations[i] = AuditClock() - starttime;
+    }
+
+    qsort(durations, records, sizeof(long long), CompareLongLong);
+    char line[128];
+    int length = snprintf(line, sizeof(line), "%lld %lld %lld\n",
+            durations[records / 2], durations[records * 99 / 100], durations[records - 1]);
+    if(write(pipefd, line, length) != length)
+        exit(EXIT_BROKEN);
+    free(durations);
+    exit(EXIT_OK);
+}
+
+
+
+static uint32_t ChecksumOf(const struct AUDITRECORD *record)
+{
+    const unsigned char *bytes = (const unsigned char*)record;
+    uint32_t hash = 2166136261U;
+    for(size_t i = 0; i < sizeof(struct AUDITRECORD); i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+
+
+/*
+ * Checks that the log has all records, and that each record was written by one writer only
+ */
+static int Verify(const char *path, unsigned long long expected)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if(fd < 0 || fstat(fd, &info) != 0)
+        return -1;
+    void *map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return -1;
+
+    const struct AUDITHEADER *header  = (const struct AUDITHEADER*)map;
+    const struct AUDITRECORD *records = (const struct AUDITRECORD*)((const char*)map + AUDIT_HEADER_SIZE);
+    unsigned long long first = header->next > header->capacity ? header->next - header->capacity : 0;
+    unsigned long long valid = 0;
+    unsigned long long stale = 0;
+    unsigned long long torn  = 0;
+    unsigned long long broken = 0;
+    for(unsigned long long ticket = first; ticket < header->next; ticket++)
+    {
+        struct AUDITRECORD record = records[ticket % header->capacity];
+        if(record.sequence != ticket + 1)
+        {
+            stale++;    // A stalled writer got this slot, see audit.c
+            continue;
+        }
+
+        uint32_t checksum = record.checksum;
+        record.checksum = 0;
+        if(ChecksumOf(&record) != checksum)
+            torn++;     // Readers skip it
+        else if(record.numprocs != (record.payloadsize ^ record.payloadhash))
+            broken++;   // A reader would have accepted a wrong record
+        else
+            valid++;
+    }
+
+    printf("records=%llu expected=%llu valid=%llu/%llu stale=%llu torn=%llu broken=%llu\n",
+            (unsigned long long)header->next, expected, valid, (unsigned long long)(header->next - first),
+            stale, torn, broken);
+    // Stalled writers can only lose records when the ring wraps
+    bool wrapped = expected > header->capacity;
+    int retval = header->next == expected && broken == 0 && (wrapped || valid == expected) ? 0 : -1;
+    munmap(map, info.st_size);
+    return retval;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+    if(argc != 4 || atoi(argv[2]) < 1 || atoi(argv[3]) < 1)
+    {
+        PrintHelp(argv[0]);
+        exit(EXIT_USAGE);
+    }
+
+    const char *path = argv[1];
+    int writers = atoi(argv[2]);
+    int records = atoi(argv[3]);
+    unlink(path);
+    setenv("ONPTS_AUDITLOG", path, 1);
+
+    int pipefd[2];
+    if(pipe(pipefd) != 0)
+        exit(EXIT_BROKEN);
+
+    for(int w = 0; w < writers; w++)
+    {
+        pid_t pid = fork();
+        if(pid == 0)
+        {
+            close(pipefd[0]);
+            Writer(w, records, pipefd[1]);
+        }
+        if(pid < 0)
+            exit(EXIT_BROKEN);
+    }
+    close(pipefd[1]);
+
+    int failed = 0;
+    for(int w = 0; w < writers; w++)
+    {
+        int status;
+        wait(&status);
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_OK)
+            failed = 1;
+    }
+
+    // Median of the writers' medians, worst p99 and max
+    long long medians[writers];
+    long long p99 = 0, max = 0;
+    FILE *results = fdopen(pipefd[0], "r");
+    int numresults = 0;
+    long long median, p, m;
+    while(numresults < writers && fscanf(results, "%lld %lld %lld", &median, &p, &m) == 3)
+    {
+        medians[numresults++] = median;
+        if(p > p99) p99 = p;
+        if(m > max) max = m;
+    }
+    fclose(results);
+    if(numresults == 0)
+        exit(EXIT_BROKEN);
+    qsort(medians, numresults, sizeof(long long), CompareLongLong);
+
+    printf("writers=%d records=%d median=%lldns p99=%lldns max=%lldus ",
+            writers, records, medians[numresults / 2], p99, max / 1000);
+    if(failed || Verify(path, (unsigned long long)writers * records) != 0)
+        exit(EXIT_BROKEN);
+    exit(EXIT_OK);
+}
+
+// vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
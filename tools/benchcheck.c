@@ -0,0 +1,115 @@
+/*
+ * onpts is a too to securely access the input buffer of other pseudo terminals
+ * Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * benchcheck runs CheckPrivileges on a (synthetic) procfs tree and measures its latency
+ * and the peak memory usage.
+ * The exit code tells the verdict, so the same fixtures can be used to verify correctness.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "proc.h"
+#include "sec.h"
+
+#define EXIT_ALLOWED    0
+#define EXIT_DENIED     1
+#define EXIT_USAGE      2
+#define BENCH_DEADLINE_MS   (10 * 60 * 1000)
+
+void PrintHelp(char *pname)
+{
+    fprintf(stderr, "\e[1;37mUsage: \e[1;36m%s\e[1;34m PROCROOT PTS UID GID [ITERATIONS]\e[0m\n", pname);
+    fprintf(stderr, "Exit code: %d if access would be allowed, %d if denied, %d on usage errors\n",
+            EXIT_ALLOWED, EXIT_DENIED, EXIT_USAGE);
+}
+
+
+
+static long long Nanoseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+
+static int CompareLongLong(const void *a, const void *b)
+{
+    long long lla = *(const long long*)a;
+    long long llb = *(const long long*)b;
+    return (lla > llb) - (lla < llb);
+}
+
+
+
+int main(int argc, char *argv[])
+{
+    if(argc < 5 || argc > 6)
+    {
+        PrintHelp(argv[0]);
+        exit(EXIT_USAGE);
+    }
+
+    char ptspath[32];
+    uid_t uid = atoi(argv[3]);
+    gid_t gid = atoi(argv[4]);
+    int iterations = argc == 6 ? atoi(argv[5]) : 10;
+    if(iterations < 1)
+        iterations = 1;
+
+    SetProcRoot(argv[1]);
+    SetCheckDeadline(BENCH_DEADLINE_MS);    // Measure the whole check, even on huge trees
+    snprintf(ptspath, sizeof(ptspath), "/dev/pts/%s", argv[2]);
+
+    long long *durations;
+    durations = (long long*)malloc(iterations * sizeof(long long));
+    if(durations == NULL)
+        exit(EXIT_USAGE);
+
+    int verdict = 0;
+    for(int i = 0; i < iterations; i++)
+    {
+        long long start = Nanoseconds();
+        verdict = CheckPrivileges(ptspath, uid, gid);
+        durations[i] = Nanoseconds() - start;
+    }
+    qsort(durations, iterations, sizeof(long long), CompareLongLong);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("verdict=%s iterations=%d min=%lldus median=%lldus max=%lldus maxrss=%ldKiB\n",
+            verdict == 0 ? "allow" : "deny",
+            iterations,
+            durations[0] / 1000,
+            durations[iterations / 2] / 1000,
+            durations[iterations - 1] / 1000,
+            usage.ru_maxrss);
+
+    free(durations);
+    return verdict == 0 ? EXIT_ALLOWED : EXIT_DENIED;
+}
+
+// vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
@@ -0,0 +1,191 @@
+/*
+ * onpts is a too to securely access the input buffer of other pseudo terminals
+ * Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * benchlock lets several processes write to the same PTS lock at the same time.
+ * It measures how long LockPTS takes and verifies that only one process at a time holds the lock.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "lock.h"
+
+#define EXIT_OK     0
+#define EXIT_BROKEN 1
+#define EXIT_USAGE  2
+
+#define PTSPATH "/dev/pts/1"
+
+/*
+ * Shared between all processes, to find out if two of them held the lock at the same time
+ */
+struct SHARED
+{
+    int inside;         // Processes holding the lock
+    int overlaps;       // Times a process found another one holding the lock
+    long long counter;  // Incremented without atomics while holding the lock
+};
+
+void PrintHelp(char *pname)
+{
+    fprintf(stderr, "\e[1;37mUsage: \e[1;36m%s\e[1;34m LOCKDIR PROCESSES ROUNDS\e[0m\n", pname);
+    fprintf(stderr, "Each of the PROCESSES takes the lock of a PTS in LOCKDIR ROUNDS times.\n");
+    fprintf(stderr, "Exit code: %d if the lock was exclusive, %d if not, %d on usage errors\n",
+            EXIT_OK, EXIT_BROKEN, EXIT_USAGE);
+}
+
+
+
+static long long Clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+
+static int CompareLongLong(const void *a, const void *b)
+{
+    long long lla = *(const long long*)a;
+    long long llb = *(const long long*)b;
+    return (lla > llb) - (lla < llb);
+}
+
+
+
+/*
+ * Takes the lock ROUNDS times and writes "median p99 max" of the waiting time in ns to the pipe
+ */
+static void Worker(struct SHARED *shared, int rounds, int pipefd)
+{
+    long long *durations = (long long*)malloc(rounds * sizeof(long long));
+    if(durations == NULL)
+        exit(EXIT_BROKEN);
+
+    struct PTSLOCK lock;
+    if(OpenPTSLock(&lock, PTSPATH) != 0)
+        exit(EXIT_BROKEN);
+
+    for(int i = 0; i < rounds; i++)
+    {
+        long long starttime = Clock();
+        if(LockPTS(&lock) != 0)
+            exit(EXIT_BROKEN);
+        durations[i] = Clock() - starttime;
+
+        if(__atomic_fetch_add(&shared->inside, 1, __ATOMIC_SEQ_CST) != 0)
+            __atomic_fetch_add(&shared->overlaps, 1, __ATOMIC_SEQ_CST);
+        long long counter = shared->counter;
+        sched_yield();      // Gives the others a chance to run into the critical section
+        shared->counter = counter + 1;
+        __atomic_fetch_sub(&shared->inside, 1, __ATOMIC_SEQ_CST);
+
+        UnlockPTS(&lock);
+    }
+    ClosePTSLock(&lock);
+
+    qsort(durations, rounds, sizeof(long long), CompareLongLong);
+    char line[128];
+    int length = snprintf(line, sizeof(line), "%lld %lld %lld\n",
+            durations[rounds / 2], durations[rounds * 99 / 100], durations[rounds - 1]);
+    if(write(pipefd, line, length) != length)
+        exit(EXIT_BROKEN);
+    free(durations);
+    exit(EXIT_OK);
+}
+
+
+
+int main(int argc, char *argv[])
+{
+    if(argc != 4 || atoi(argv[2]) < 1 || atoi(argv[3]) < 1)
+    {
+        PrintHelp(argv[0]);
+        exit(EXIT_USAGE);
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/pts1.lock", argv[1]);
+    int processes = atoi(argv[2]);
+    int rounds    = atoi(argv[3]);
+    unlink(path);
+    setenv("ONPTS_LOCKDIR", argv[1], 1);
+    SetLockTimeout(60 * 1000);
+
+    struct SHARED *shared = mmap(NULL, sizeof(struct SHARED), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    int pipefd[2];
+    if(shared == MAP_FAILED || pipe(pipefd) != 0)
+        exit(EXIT_BROKEN);
+    memset(shared, 0, sizeof(struct SHARED));
+
+    for(int p = 0; p < processes; p++)
+    {
+        pid_t pid = fork();
+        if(pid == 0)
+        {
+            close(pipefd[0]);
+            Worker(shared, rounds, pipefd[1]);
+        }
+        if(pid < 0)
+            exit(EXIT_BROKEN);
+    }
+    close(pipefd[1]);
+
+    int failed = 0;
+    for(int p = 0; p < processes; p++)
+    {
+        int status;
+        wait(&status);
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_OK)
+            failed = 1;
+    }
+
+    // Median of the processes' medians, worst p99 and max
+    long long medians[processes];
+    long long p99 = 0, max = 0;
+    FILE *results = fdopen(pipefd[0], "r");
+    int numresults = 0;
+    long long median, p, m;
+    while(numresults < processes && fscanf(results, "%lld %lld %lld", &median, &p, &m) == 3)
+    {
+        medians[numresults++] = median;
+        if(p > p99) p99 = p;
+        if(m > max) max = m;
+    }
+    fclose(results);
+    if(numresults == 0)
+        exit(EXIT_BROKEN);
+    qsort(medians, numresults, sizeof(long long), CompareLongLong);
+
+    long long expected = (long long)processes * rounds;
+    printf("processes=%d rounds=%d median=%lldns p99=%lldns max=%lldus count=%lld/%lld overlaps=%d\n",
+            processes, rounds, medians[numresults / 2], p99, max / 1000,
+            shared->counter, expected, shared->overlaps);
+    if(failed || shared->counter != expected || shared->overlaps != 0)
+        exit(EXIT_BROKEN);
+    exit(EXIT_OK);
+}
+
+// vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
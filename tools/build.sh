@@ -0,0 +1,45 @@
+#!/usr/bin/env bash
+
+# Builds the tools to generate synthetic procfs trees and to benchmark the privilege checker.
+# benchcheck links the same sources onpts uses for its privilege check.
+# benchaudit stresses the audit log with several writers.
+# benchlock stresses the lock of a PTS with several processes.
+
+cd "$(dirname "$0")"
+
+HEADER="-I.. -I../fein"
+LIBS="-lpthread"
+CHECKER="../sec.c ../proc.c ../fein/fileindir.c ../fein/lineinfile.c ../fein/tokeninstring.c"
+
+echo -e "\e[1;34mCompiling mkprocfs …\e[0m"
+clang -g -Wno-multichar --std=gnu99 -O2 -o mkprocfs mkprocfs.c
+if [[ $? -ne 0 ]] ; then
+    echo -e "\e[1;31mfailed\e[0m"
+    exit 1
+fi
+
+echo -e "\e[1;34mCompiling benchcheck …\e[0m"
+clang -g -Wno-multichar --std=gnu99 $HEADER -O2 -o benchcheck benchcheck.c $CHECKER $LIBS
+if [[ $? -ne 0 ]] ; then
+    echo -e "\e[1;31mfailed\e[0m"
+    exit 1
+fi
+
+echo -e "\e[1;34mCompiling benchaudit …\e[0m"
+clang -g -Wno-multichar --std=gnu99 $HEADER -O2 -o benchaudit benchaudit.c ../audit.c ../proc.c $LIBS
+if [[ $? -ne 0 ]] ; then
+    echo -e "\e[1;31mfailed\e[0m"
+    exit 1
+fi
+
+echo -e "\e[1;34mCompiling benchlock …\e[0m"
+clang -g -Wno-multichar --std=gnu99 $HEADER -O2 -o benchlock benchlock.c ../lock.c ../proc.c $LIBS
+if [[ $? -ne 0 ]] ; then
+    echo -e "\e[1;31mfailed\e[0m"
+    exit 1
+fi
+
+echo -e "\e[1;32mdone\e[0m"
+
+# vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+
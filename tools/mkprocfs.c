@@ -0,0 +1,257 @@
+/*
+ * onpts is a too to securely access the input buffer of other pseudo terminals
+ * Copyright (C) 2017  Ralf Stemmer <ralf.stemmer@gmx.net>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * mkprocfs writes a synthetic procfs tree that can be used as proc root for onpts.
+ * It contains exactly the files onpts reads:
+ *  $PID/stat, $PID/status, $PID/fd/$FD, $PID/task/$TID/children
+ *
+ * The tree processes are arranged as a tree of the given width below one session leader.
+ * All of them have the PTS as controlling terminal and opened as stdin, stdout and stderr,
+ * like processes started from a shell have.
+ * Background processes are not related to the PTS and have mixed credentials.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define FIRST_PID   100
+#define FIRST_TID   1000000 // Thread IDs of the additional tasks
+#define PTS_MAJOR   136
+
+static const char *rootdir;
+static int  opt_pts        = 1;
+static long opt_processes  = 100;
+static long opt_width      = 4;
+static long opt_tasks      = 1;
+static long opt_background = 0;
+static unsigned int opt_uid = 1000;
+static unsigned int opt_gid = 1000;
+static long opt_baduid     = -1;    // Index of the tree process with a different UID
+static long opt_badgid     = -1;    // Index of the tree process with a different GID
+static int  opt_badfield   = 1;     // 0: real, 1: effective, 2: saved, 3: filesystem
+
+void PrintHelp(char *pname)
+{
+    fprintf(stderr, "\e[1;37mUsage: \e[1;36m%s\e[1;34m DIRECTORY [options]\e[0m\n", pname);
+    fprintf(stderr, "\t\e[1;36m-p PTS  \t\e[1;34mPTS number of the process tree (default: 1)\e[0m\n");
+    fprintf(stderr, "\t\e[1;36m-n COUNT\t\e[1;34mNumber of processes on the PTS (default: 100)\e[0m\n");
+    fprintf(stderr, "\t\e[1;36m-w WIDTH\t\e[1;34mChildren per process, 1 makes a chain (default: 4)\e[0m\n");
+    fprintf(stderr, "\t\e[1;36m-t TASKS\t\e[1;34mTasks per process, children get distributed over them (default: 1)\e[0m\n");
+    fprintf(stderr, "\t\e[1;36m-b COUNT\t\e[1;34mBackground processes not on the PTS (default: 0)\e[0m\n");
+    fprintf(stderr, "\t\e[1;36m-u UID  \t\e[1;34mUID of the processes on the PTS (default: 1000)\e[0m\n");
+    fprintf(stderr, "\t\e[1;36m-g GID  \t\e[1;34mGID of the processes on the PTS (default: 1000)\e[0m\n");
+    fprintf(stderr, "\t\e[1;36m-U INDEX\t\e[1;34mProcess INDEX of the tree gets a different UID (0 is the session leader)\e[0m\n");
+    fprintf(stderr, "\t\e[1;36m-G INDEX\t\e[1;34mProcess INDEX of the tree gets a different GID\e[0m\n");
+    fprintf(stderr, "\t\e[1;36m-f FIELD\t\e[1;34mWhich ID differs: 0 real, 1 effective, 2 saved, 3 filesystem (default: 1)\e[0m\n");
+}
+
+
+
+static int WriteFile(const char *path, const char *content)
+{
+    FILE *fp;
+    fp = fopen(path, "w");
+    if(!fp)
+    {
+        fprintf(stderr, "\e[1;31mfopen(\"%s\", \"w\"); failed with error: ", path);
+        fprintf(stderr, "\e[1;31m%s\e[0m\n", strerror(errno));
+        return -1;
+    }
+    fputs(content, fp);
+    fclose(fp);
+    return 0;
+}
+
+
+
+static int MakeDirectory(const char *path)
+{
+    if(mkdir(path, 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "\e[1;31mmkdir(\"%s\"); failed with error: ", path);
+        fprintf(stderr, "\e[1;31m%s\e[0m\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/*
+ * Writes one process.
+ *
+ * Args:
+ *  pid, ppid, sid: IDs of the process
+ *  ctty:           PTS number of the controlling terminal, -1 for none
+ *  uid, gid:       The four IDs of the process
+ *  tasks:          Number of tasks
+ *  children:       PIDs of the children
+ *  numchildren:    Number of children
+ */
+static int WriteProcess(int pid, int ppid, int sid, int ctty, const unsigned int uid[4], const unsigned int gid[4],
+        long tasks, const int *children, long numchildren)
+{
+    char path[4096];
+    char content[16384];
+
+    snprintf(path, sizeof(path), "%s/%d", rootdir, pid);
+    if(MakeDirectory(path))
+        return -1;
+
+    // stat
+    int ttynr = 0;
+    if(ctty >= 0)
+        ttynr = (ctty & 0xff) | (PTS_MAJOR << 8) | ((ctty & ~0xff) << 12);
+    snprintf(path, sizeof(path), "%s/%d/stat", rootdir, pid);
+    snprintf(content, sizeof(content),
+            "%d (proc %d) S %d %d %d %d %d 4194304 0 0 0 0 0 0 0 0 20 0 %ld 0 %d 0 0\n",
+            pid, pid, ppid, sid, sid, ttynr, ctty >= 0 ? sid : -1, tasks, pid);
+    if(WriteFile(path, content))
+        return -1;
+
+    // status
+    snprintf(path, sizeof(path), "%s/%d/status", rootdir, pid);
+    snprintf(content, sizeof(content),
+            "Name:\tproc %d\nState:\tS (sleeping)\nTgid:\t%d\nPid:\t%d\nPPid:\t%d\n"
+            "Uid:\t%u\t%u\t%u\t%u\nGid:\t%u\t%u\t%u\t%u\nThreads:\t%ld\n",
+            pid, pid, pid, ppid,
+            uid[0], uid[1], uid[2], uid[3],
+            gid[0], gid[1], gid[2], gid[3],
+            tasks);
+    if(WriteFile(path, content))
+        return -1;
+
+    // fd
+    snprintf(path, sizeof(path), "%s/%d/fd", rootdir, pid);
+    if(MakeDirectory(path))
+        return -1;
+    for(int fd = 0; fd < 3; fd++)
+    {
+        char target[64];
+        if(ctty >= 0)
+            snprintf(target, sizeof(target), "/dev/pts/%d", ctty);
+        else
+            snprintf(target, sizeof(target), "/dev/null");
+        snprintf(path, sizeof(path), "%s/%d/fd/%d", rootdir, pid, fd);
+        if(symlink(target, path) != 0 && errno != EEXIST)
+        {
+            fprintf(stderr, "\e[1;31msymlink(\"%s\"); failed with error: ", path);
+            fprintf(stderr, "\e[1;31m%s\e[0m\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    // task/$TID/children - The children get distributed over all tasks
+    snprintf(path, sizeof(path), "%s/%d/task", rootdir, pid);
+    if(MakeDirectory(path))
+        return -1;
+    for(long task = 0; task < tasks; task++)
+    {
+        long tid = task == 0 ? pid : FIRST_TID + (long)pid * tasks + task;
+        snprintf(path, sizeof(path), "%s/%d/task/%ld", rootdir, pid, tid);
+        if(MakeDirectory(path))
+            return -1;
+
+        size_t length = 0;
+        content[0] = '\0';
+        for(long child = task; child < numchildren; child += tasks)
+            length += snprintf(content + length, sizeof(content) - length, "%d ", children[child]);
+
+        snprintf(path, sizeof(path), "%s/%d/task/%ld/children", rootdir, pid, tid);
+        if(WriteFile(path, content))
+            return -1;
+    }
+    return 0;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while((opt = getopt(argc, argv, "p:n:w:t:b:u:g:U:G:f:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'p': opt_pts        = atoi(optarg); break;
+            case 'n': opt_processes  = atol(optarg); break;
+            case 'w': opt_width      = atol(optarg); break;
+            case 't': opt_tasks      = atol(optarg); break;
+            case 'b': opt_background = atol(optarg); break;
+            case 'u': opt_uid        = atoi(optarg); break;
+            case 'g': opt_gid        = atoi(optarg); break;
+            case 'U': opt_baduid     = atol(optarg); break;
+            case 'G': opt_badgid     = atol(optarg); break;
+            case 'f': opt_badfield   = atoi(optarg) & 3; break;
+            default:
+                PrintHelp(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if(optind != argc - 1 || opt_processes < 1 || opt_width < 1 || opt_tasks < 1 || opt_width > 1000)
+    {
+        PrintHelp(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    rootdir = argv[optind];
+    if(MakeDirectory(rootdir))
+        exit(EXIT_FAILURE);
+
+    // Process tree on the PTS. Process i has the children width*i+1 … width*i+width
+    int sid = FIRST_PID;
+    int children[1000];
+    for(long i = 0; i < opt_processes; i++)
+    {
+        unsigned int uid[4] = {opt_uid, opt_uid, opt_uid, opt_uid};
+        unsigned int gid[4] = {opt_gid, opt_gid, opt_gid, opt_gid};
+        if(i == opt_baduid)
+            uid[opt_badfield] = 0;
+        if(i == opt_badgid)
+            gid[opt_badfield] = 0;
+
+        long numchildren = 0;
+        for(long child = opt_width * i + 1; child <= opt_width * i + opt_width && child < opt_processes; child++)
+            children[numchildren++] = FIRST_PID + child;
+
+        int ppid = i == 0 ? 1 : FIRST_PID + (i - 1) / opt_width;
+        if(WriteProcess(FIRST_PID + i, ppid, sid, opt_pts, uid, gid, opt_tasks, children, numchildren))
+            exit(EXIT_FAILURE);
+    }
+
+    // Background processes with mixed credentials
+    for(long i = 0; i < opt_background; i++)
+    {
+        int pid = FIRST_PID + opt_processes + i;
+        unsigned int id = i % 3 == 0 ? 0 : 1000 + i % 7;
+        unsigned int uid[4] = {id, id, id, id};
+        unsigned int gid[4] = {id, id, id, id};
+        if(WriteProcess(pid, 1, pid, -1, uid, gid, 1, NULL, 0))
+            exit(EXIT_FAILURE);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// vim: tabstop=4 expandtab shiftwidth=4 softtabstop=4
+